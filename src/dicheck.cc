@@ -64,6 +64,25 @@ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <string.h>
 #include <errno.h>
 #include <libgen.h> /* for basename */
+#include <strings.h> /* for strncasecmp */
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "dicheckrules.h"
+#include "dicheckbin.h"
 
 using std::ofstream;
 using std::ifstream;
@@ -71,6 +90,7 @@ using std::string;
 using std::cout;
 using std::endl;
 using std::cin;
+using std::vector;
 
 // Usage:  dicheck  file ...
 
@@ -80,222 +100,1142 @@ static unsigned errcount = 0;
 static bool checklinelength = true; //cannot be turned off now.
 static bool pythonsource = false;
 static long  maxlinelength = 70;
+static bool summarymode = false;
+// With --tar the named files are tar archives.
+static bool tarmode = false;
+// For --shard=K/N, shardcount 0 means not sharding.
+static unsigned shardindex = 0;
+static unsigned shardcount = 0;
 
 #define OURBUFSIZ  2000
 static unsigned char inbuf[OURBUFSIZ+1];
 static unsigned inpos = 0;
 static unsigned incharcount = 0;
 
-// bsb stands for brace space brace
-// as in
-//     }
-// blankline
-//     }
-//suggesting the blankline is pointless.
-static int bsb[2] = {-1,-1};
+// --columns=<mode> chooses how line lengths and
+// columns are counted.  Byte counts are the default.
+enum colmode { COL_BYTES, COL_CODEPOINTS, COL_WIDTH };
+static colmode columnmode = COL_BYTES;
+// Line length in columns and offset of the first bad
+// UTF-8 byte (or -1) of the line in inbuf, when not
+// counting bytes.
+static unsigned linecolumns = 0;
+static int linebadutf8 = -1;
+// The LSP server wants byte columns, it converts them.
+static bool lspmode = false;
+
+// For --summary.  Nothing is formatted per diagnostic,
+// we just count them here and report at the end.
+#define LENBUCKETS   21 /* 10 wide, the last is 200+ */
+#define DEPTHBUCKETS 17 /* the last is 16+ levels */
+struct filesummary {
+    string path;
+    unsigned long lines;
+    unsigned long total;
+    unsigned long byrule[R_COUNT];
+};
+static vector<filesummary> summaryfiles;
+static unsigned long summaryrules[R_COUNT];
+static unsigned long lengthhist[LENBUCKETS];
+static unsigned long depthhist[DEPTHBUCKETS];
+#define WORSTFILES 20
 
 static void
-resetbsb()
+summary_newfile(const string &path)
 {
-    bsb[0] = -1;
-    bsb[1] = -1;
+    filesummary fs;
+
+    fs.path = path;
+    fs.lines = 0;
+    fs.total = 0;
+    memset(fs.byrule,0,sizeof(fs.byrule));
+    summaryfiles.push_back(fs);
 }
+
+// Called by the scanner, so it must not touch summaryfiles.
 static void
-newbsbblank(int line)
+summary_line(unsigned length, bool blank, unsigned indent)
 {
-    if (bsb[0] != -1) {
-        bsb[1] = line;
+    unsigned b = length/10;
+
+    lengthhist[b < LENBUCKETS? b : LENBUCKETS-1]++;
+    if (!blank) {
+        b = indent/indentamount;
+        depthhist[b < DEPTHBUCKETS? b : DEPTHBUCKETS-1]++;
     }
 }
+
+static bool
+worse_file(const filesummary *a, const filesummary *b)
+{
+    return a->total > b->total;
+}
+
+static bool
+worse_rule(unsigned a, unsigned b)
+{
+    return summaryrules[a] > summaryrules[b];
+}
+
 static void
-newbsbbrace(int line, string &path)
+print_summary()
 {
-    if (bsb[0] == -1) {
-        bsb[0] = line;
+    unsigned long lines = 0;
+    unsigned long total = 0;
+    vector<const filesummary *> worst;
+    vector<unsigned> rules;
+    unsigned i = 0;
+
+    for (i = 0; i < summaryfiles.size(); ++i) {
+        lines += summaryfiles[i].lines;
+        total += summaryfiles[i].total;
+        if (summaryfiles[i].total) {
+            worst.push_back(&summaryfiles[i]);
+        }
+    }
+    cout << "dicheck summary: " << summaryfiles.size() <<
+        " files, " << lines << " lines, " << total <<
+        " diagnostics" << endl;
+    for (i = 0; i < R_COUNT; ++i) {
+        if (summaryrules[i]) {
+            rules.push_back(i);
+        }
+    }
+    std::stable_sort(rules.begin(),rules.end(),worse_rule);
+    cout << "Diagnostics by rule:" << endl;
+    for (i = 0; i < rules.size(); ++i) {
+        cout << std::setw(10) << summaryrules[rules[i]] <<
+            "  " << rulenames[rules[i]] << endl;
+    }
+    std::stable_sort(worst.begin(),worst.end(),worse_file);
+    if (worst.size() > WORSTFILES) {
+        worst.resize(WORSTFILES);
+    }
+    cout << "Worst files:" << endl;
+    for (i = 0; i < worst.size(); ++i) {
+        const filesummary *fs = worst[i];
+        unsigned top = 0;
+        unsigned r = 1;
+
+        for ( ; r < R_COUNT; ++r) {
+            if (fs->byrule[r] > fs->byrule[top]) {
+                top = r;
+            }
+        }
+        cout << std::setw(10) << fs->total << "  " <<
+            fs->path << " (mostly " << rulenames[top] <<
+            ")" << endl;
+    }
+    cout << "Line length histogram:" << endl;
+    for (i = 0; i < LENBUCKETS; ++i) {
+        std::ostringstream label;
+
+        if (i == LENBUCKETS-1) {
+            label << i*10 << "+";
+        } else {
+            label << i*10 << "-" << i*10+9;
+        }
+        cout << std::setw(10) << label.str() <<
+            std::setw(10) << lengthhist[i] << endl;
+    }
+    cout << "Indent depth histogram:" << endl;
+    for (i = 0; i < DEPTHBUCKETS; ++i) {
+        std::ostringstream label;
+
+        label << i;
+        if (i == DEPTHBUCKETS-1) {
+            label << "+";
+        }
+        cout << std::setw(10) << label.str() <<
+            std::setw(10) << depthhist[i] << endl;
+    }
+}
+
+// For --binary=<f>.  Diagnostics are kept with an
+// index into binpaths and written out, sorted, at the end.
+static bool binarymode = false;
+static string binaryfile;
+static vector<string> binpaths;
+static std::map<string,unsigned> binpathindex;
+static vector<binrecord> binrecords;
+
+static void
+binary_record(const diag &d, const string &path)
+{
+    static unsigned lastindex = 0;
+    binrecord r;
+
+    if (binpaths.empty() || binpaths[lastindex] != path) {
+        std::map<string,unsigned>::iterator it =
+            binpathindex.find(path);
+
+        if (it == binpathindex.end()) {
+            lastindex = binpaths.size();
+            binpathindex[path] = lastindex;
+            binpaths.push_back(path);
+        } else {
+            lastindex = it->second;
+        }
+    }
+    r.path = lastindex;
+    r.d = d;
+    binrecords.push_back(r);
+}
+
+static void
+write_binary()
+{
+    vector<unsigned> remap(binpaths.size());
+    std::map<string,unsigned>::iterator it;
+    unsigned i = 0;
+
+    // Records are sorted by path index but bin_compare()
+    // orders them by path name, so the format needs the
+    // path table in sorted path order.  The map iterates
+    // in that order, not command line order, so path
+    // indices are reassigned here to match.
+    for (it = binpathindex.begin(); it != binpathindex.end();
+        ++it, ++i) {
+        remap[it->second] = i;
+        binpaths[i] = it->first;
+    }
+    for (i = 0; i < binrecords.size(); ++i) {
+        binrecords[i].path = remap[binrecords[i].path];
+    }
+    std::sort(binrecords.begin(),binrecords.end(),binrecord_less);
+    if (!bin_write(binaryfile,binpaths,binrecords)) {
+        cout << "Cannot write " << binaryfile << endl;
+        exit(1);
+    }
+}
+
+static void stop_pipeline();
+
+// Output side of reporting: print or count one diagnostic.
+static void
+emit_diag(const diag &d, const string &path)
+{
+    if (binarymode) {
+        binary_record(d,path);
+    }
+    if (d.rule == R_NOTTEXT) {
+        format_diag(cout,d,path);
+        if (!tarmode) {
+            stop_pipeline();
+            exit(1);
+        }
+        // Archives often hold binaries, just skip them.
         return;
     }
-    if (bsb[1] != -1) {
-        if (line == (bsb[1]+1)) {
-            if (line == (bsb[0]+2)) {
-                cout << line << " of " << path  <<
-                    " is blank surrounded by }" << endl;
+    if (summarymode) {
+        filesummary &fs = summaryfiles.back();
+
+        fs.total++;
+        fs.byrule[d.rule]++;
+        summaryrules[d.rule]++;
+        return;
+    }
+    format_diag(cout,d,path);
+}
+
+// East Asian wide and fullwidth characters take two
+// columns, combining marks and zero width spaces none.
+// Sorted, for a binary search.
+struct cprange {
+    unsigned long lo;
+    unsigned long hi;
+    unsigned width;
+};
+static const cprange widthranges[] = {
+    {0x0300,0x036f,0},{0x1100,0x115f,2},{0x1ab0,0x1aff,0},
+    {0x1dc0,0x1dff,0},{0x200b,0x200f,0},{0x20d0,0x20ff,0},
+    {0x2e80,0x303e,2},{0x3041,0x33ff,2},{0x3400,0x4dbf,2},
+    {0x4e00,0x9fff,2},{0xa000,0xa4cf,2},{0xac00,0xd7a3,2},
+    {0xf900,0xfaff,2},{0xfe00,0xfe0f,0},{0xfe20,0xfe2f,0},
+    {0xfe30,0xfe4f,2},{0xff00,0xff60,2},{0xffe0,0xffe6,2},
+    {0x1f300,0x1f64f,2},{0x1f900,0x1f9ff,2},
+    {0x20000,0x2fffd,2},{0x30000,0x3fffd,2}
+};
+#define WIDTHRANGES (sizeof(widthranges)/sizeof(widthranges[0]))
+
+static unsigned
+range_width(unsigned long cp)
+{
+    unsigned lo = 0;
+    unsigned hi = WIDTHRANGES;
+
+    while (lo < hi) {
+        unsigned mid = (lo+hi)/2;
+
+        if (cp < widthranges[mid].lo) {
+            hi = mid;
+        } else if (cp > widthranges[mid].hi) {
+            lo = mid+1;
+        } else {
+            return widthranges[mid].width;
+        }
+    }
+    return 1;
+}
+
+// The width shared by all the code points in each
+// 256 code point block of the BMP, or MIXEDWIDTH.
+#define MIXEDWIDTH 3
+static unsigned char bmpwidth[256];
+
+static void
+init_widths()
+{
+    unsigned long blk = 0;
+    unsigned long c = 0;
+
+    for (blk = 0; blk < 256; ++blk) {
+        unsigned w = range_width(blk << 8);
+
+        for (c = 1; c < 256; ++c) {
+            if (range_width((blk << 8) | c) != w) {
+                w = MIXEDWIDTH;
+                break;
             }
         }
+        bmpwidth[blk] = w;
     }
-    resetbsb();
-    bsb[0] = line;
 }
 
+static unsigned
+cp_width(unsigned long cp)
+{
+    if (columnmode != COL_WIDTH || cp < 0x300) {
+        return 1;
+    }
+    if (cp < 0x10000) {
+        unsigned w = bmpwidth[cp >> 8];
+
+        if (w != MIXEDWIDTH) {
+            return w;
+        }
+    }
+    return range_width(cp);
+}
+
+// Decodes the non-ASCII sequence at p[i], advancing i.
+// Returns false for an invalid sequence, after
+// stepping over just its first byte.
 static bool
-lastnmatch(const char *test_string,
-    int curpos)
+decode_utf8(const unsigned char *p, unsigned len,
+    unsigned &i, unsigned long &cp)
 {
-    int testlen = strlen(test_string);
+    unsigned char c = p[i];
+    unsigned n = 0;
+    unsigned long min = 0;
+    unsigned k = 0;
 
-    if (testlen > curpos) {
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 1;
+        cp = c & 0x1f;
+        min = 0x80;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 2;
+        cp = c & 0x0f;
+        min = 0x800;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 3;
+        cp = c & 0x07;
+        min = 0x10000;
+    } else {
+        ++i;
         return false;
     }
-    int startindex = curpos-testlen;
-    if (strncmp(test_string,
-        (const char *)(inbuf+startindex),testlen)) {
+    if (i + n >= len) {
+        ++i;
+        return false;
+    }
+    for (k = 1; k <= n; ++k) {
+        if ((p[i+k] & 0xc0) != 0x80) {
+            ++i;
+            return false;
+        }
+        cp = (cp << 6) | (p[i+k] & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff ||
+        (cp >= 0xd800 && cp <= 0xdfff)) {
+        ++i;
         return false;
     }
+    i += n+1;
     return true;
 }
 
-const char *pdebug = "printf";
-const char *pflush = "fflush";
-static bool
-is_debug_line(const char * line) 
+// Counts the columns in the first len bytes of p a
+// character at a time.
+// If bad is not null it gets the offset of the first
+// invalid UTF-8 byte, or -1.
+static unsigned
+measure_utf8_bytewise(const unsigned char *p, unsigned len,
+    int *bad)
 {
-    if (!strncmp((const char *)inbuf,pdebug,6)) {
-        return true;
+    unsigned cols = 0;
+    unsigned i = 0;
+
+    if (bad) {
+        *bad = -1;
     }
-    if (!strncmp((const char *)inbuf,pflush,6)) {
-        return true;
+    while (i < len) {
+        if (p[i] < 0x80) {
+            ++cols;
+            ++i;
+            continue;
+        }
+        unsigned long cp = 0;
+        unsigned start = i;
+        if (!decode_utf8(p,len,i,cp)) {
+            if (bad && *bad < 0) {
+                *bad = start;
+            }
+            // Count a bad byte as one column.
+            ++cols;
+            continue;
+        }
+        cols += cp_width(cp);
     }
-    return false;
+    return cols;
 }
 
-static void
-process_a_line(int line,
-    string   &path,
-    bool&     incomment,
-    bool&     lastlinemacro,
-    bool&     found_nonblank_ever,
-    unsigned& lastlineindent,
-    unsigned& current_blankline_count,
-    unsigned& sequential_blankline_count)
+#ifdef __SSE2__
+// x >= k, comparing the bytes as unsigned.
+static inline __m128i
+ge_u8(__m128i x, unsigned char k)
 {
-    unsigned char c = 0;
-    bool leadingchar = false;
-    char leadingcharv = ' ';
-    bool curlinemacro  = false;
-    bool blankline     = true;
-    bool inquotes = false;
-    bool insquote = false;
-    bool trailingwhitespace = false;
-    bool onelinecomment = false; // Meaning C++ comment.
-    int  curlineindent = 0;
+    return _mm_cmpeq_epi8(_mm_max_epu8(x,_mm_set1_epi8(k)),x);
+}
 
-    if (is_debug_line((const char *)inbuf)) {
-        cout << line << " of " << path  <<
-            " seems to be leftover debug printf" << endl;
-    }
-    for (inpos = 0 ; inpos < incharcount ; ++inpos) {
-        c = inbuf[inpos];
-        bool onquoteterminator = false;
+static inline __m128i
+eq_u8(__m128i x, unsigned char k)
+{
+    return _mm_cmpeq_epi8(x,_mm_set1_epi8(k));
+}
 
-        if (c == '\n') {
-            if (!leadingchar) {
-                newbsbblank(line);
-            } else if (leadingcharv == '}') {
-                newbsbbrace(line,path);
-            }
-        } else if (!leadingchar && c != ' ') {
-            leadingchar = true;
-            leadingcharv =  c;
+// As measure_utf8_bytewise(), but checks and counts
+// 16 bytes at a time.  The code points are the bytes
+// that are not 10xxxxxx continuation bytes: those are
+// the bytes that are above 0xbf as signed chars.
+// A byte must be a continuation byte just when one of
+// the three before it starts a longer sequence.  The
+// overlong, surrogate and too large forms all show in
+// the lead byte or the byte after it.  Only lines with
+// an error go to measure_utf8_bytewise(), to find it.
+// For widths only lead bytes of 0xcc and up, which
+// start code points from 0x300, need decoding.
+static unsigned
+measure_utf8(const unsigned char *p, unsigned len, int *bad)
+{
+    __m128i prev = _mm_setzero_si128();
+    __m128i err = _mm_setzero_si128();
+    unsigned char tail[16];
+    unsigned cols = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < len; i += 16) {
+        const unsigned char *b = p+i;
+        unsigned n = len - i;
+        unsigned linemask = 0xffff;
+
+        if (n < 16) {
+            memset(tail,0,sizeof(tail));
+            memcpy(tail,b,n);
+            b = tail;
+            linemask = (1u << n) - 1;
         }
-        switch(c) {
-        case ' ':
-            if (inquotes || insquote) {
-                break;
-            }
-            trailingwhitespace += 1;
-            break;
-        case '\n': {
-            bool saidleadingblank = false;
+        __m128i cur = _mm_loadu_si128((const __m128i *)b);
+        if (!_mm_movemask_epi8(_mm_or_si128(cur,prev))) {
+            // All ASCII.
+            cols += (n < 16)? n: 16;
+            prev = cur;
+            continue;
+        }
+        __m128i prev1 = _mm_or_si128(_mm_slli_si128(cur,1),
+            _mm_srli_si128(prev,15));
+        __m128i prev2 = _mm_or_si128(_mm_slli_si128(cur,2),
+            _mm_srli_si128(prev,14));
+        __m128i prev3 = _mm_or_si128(_mm_slli_si128(cur,3),
+            _mm_srli_si128(prev,13));
+        __m128i need = _mm_or_si128(ge_u8(prev1,0xc0),
+            _mm_or_si128(ge_u8(prev2,0xe0),ge_u8(prev3,0xf0)));
+        __m128i cont = _mm_cmplt_epi8(cur,
+            _mm_set1_epi8((char)0xc0));
+        __m128i ge_a0 = ge_u8(cur,0xa0);
+        __m128i ge_90 = ge_u8(cur,0x90);
 
-            if (inquotes || insquote) {
-                cout << line << " of " << path  <<
-                    " has a non-terminated quote"<< endl;
-            }
-            if (blankline) {
-                newbsbblank(line);
-                if (!found_nonblank_ever) {
-                    cout << line << " of " << path  <<
-                        " is a leading blank line "<< endl;
-                    saidleadingblank = true;
-                }
-            } else {
-                current_blankline_count = 0;
-            }
-            if (curlineindent%indentamount) {
-                if (incomment && (curlineindent <= 3)) {
-                    // For our copyright and other comment blocks.
-                    if (!saidleadingblank && showtrailingspaces &&
-                        trailingwhitespace) {
-                        cout << line << ":" << inpos <<
-                            " of " << path <<
-                            " has " << trailingwhitespace <<
-                            " whitespace chars on the end. " << endl;
-                        errcount++;
+        err = _mm_or_si128(err,_mm_xor_si128(need,cont));
+        err = _mm_or_si128(err,_mm_or_si128(eq_u8(cur,0xc0),
+            _mm_or_si128(eq_u8(cur,0xc1),ge_u8(cur,0xf5))));
+        err = _mm_or_si128(err,
+            _mm_andnot_si128(ge_a0,eq_u8(prev1,0xe0)));
+        err = _mm_or_si128(err,
+            _mm_and_si128(ge_a0,eq_u8(prev1,0xed)));
+        err = _mm_or_si128(err,
+            _mm_andnot_si128(ge_90,eq_u8(prev1,0xf0)));
+        err = _mm_or_si128(err,
+            _mm_and_si128(ge_90,eq_u8(prev1,0xf4)));
+        unsigned starts = _mm_movemask_epi8(_mm_cmpgt_epi8(cur,
+            _mm_set1_epi8((char)0xbf)));
+        cols += __builtin_popcount(starts & linemask);
+        if (columnmode == COL_WIDTH) {
+            unsigned wide = _mm_movemask_epi8(ge_u8(cur,0xcc)) &
+                linemask;
+
+            while (wide) {
+                unsigned at = i + __builtin_ctz(wide);
+                unsigned char c = p[at];
+                unsigned long cp = 0;
+
+                wide &= wide - 1;
+                // Any errors are caught by err, this
+                // need only stay inside the line.
+                if (c < 0xe0) {
+                    if (at + 1 < len) {
+                        cp = ((c & 0x1f) << 6) | (p[at+1] & 0x3f);
                     }
-                    break;
-                }
-                cout << line << ":" << curlineindent << " of "
-                    << path <<
-                    " has a bad indent. " << endl;
-                errcount++;
-            } else {
-                if (curlineindent == lastlineindent) {
-                    // OK.
-                } else if ( curlineindent < lastlineindent) {
-                    if (!blankline && !curlinemacro) {
-                        // OK. we allow skipping back a
-                        // fair amount due to function
-                        // calls adding nesting.
-                        lastlineindent = curlineindent;
+                } else if (c < 0xf0) {
+                    if (at + 2 < len) {
+                        cp = ((c & 0x0f) << 12) |
+                            ((p[at+1] & 0x3f) << 6) |
+                            (p[at+2] & 0x3f);
                     }
-                } else if ( (curlineindent >= indentamount) &&
-                    (((curlineindent - indentamount) ==
-                        lastlineindent) ||
-                    (lastlinemacro)) ) {
-                    // lastline macro means ignore the indent
-                    // of the macro in the last line.
-                    // This is not a great fit with python :-)
-                    lastlineindent = curlineindent;
-                    // OK.
-                } else {
-                    cout << line << ":" << inpos << " of "
-                        << path <<
-                        " has a bad indent change, last indent "
-                        <<
-                        lastlineindent << "  cur indent "
-                        << curlineindent << endl;
-                    errcount++;
+                } else if (at + 3 < len) {
+                    cp = ((unsigned long)(c & 0x07) << 18) |
+                        ((p[at+1] & 0x3f) << 12) |
+                        ((p[at+2] & 0x3f) << 6) |
+                        (p[at+3] & 0x3f);
                 }
+                cols += cp_width(cp);
+                cols -= 1;
             }
-            lastlinemacro = curlinemacro;
+        }
+        prev = cur;
+    }
+    // A sequence cut off by the end of the line.
+    err = _mm_or_si128(err,
+        _mm_or_si128(ge_u8(_mm_srli_si128(prev,15),0xc0),
+        _mm_or_si128(ge_u8(_mm_srli_si128(prev,14),0xe0),
+        ge_u8(_mm_srli_si128(prev,13),0xf0))));
+    if (_mm_movemask_epi8(err)) {
+        return measure_utf8_bytewise(p,len,bad);
+    }
+    if (bad) {
+        *bad = -1;
+    }
+    return cols;
+}
+#else
+static unsigned
+measure_utf8(const unsigned char *p, unsigned len, int *bad)
+{
+    return measure_utf8_bytewise(p,len,bad);
+}
+#endif
 
-            if (!saidleadingblank && showtrailingspaces &&
-                trailingwhitespace) {
-                cout << line << ":" << inpos << " of " << path <<
-                    " has " << trailingwhitespace <<
-                    " whitespace chars on the end. " << endl;
-                errcount++;
-            }
-            if (checklinelength) {
-                /*  Let the initial few lines run over,
-                    they are copyright notices. */
-                if (inpos > maxlinelength &&
-                    line > 6) {
-                    cout << line << ": " << inpos <<
-                        " of " << path <<
-                        "  is " << inpos << " characters long"
-                        <<endl;
-                }
-            }
-            trailingwhitespace = 0;
-            if (!blankline && !curlinemacro) {
-                lastlineindent = curlineindent;
+// Converts a byte offset in the current line to a column.
+static unsigned
+column_of(unsigned byteoffset)
+{
+    if (columnmode == COL_BYTES || lspmode || !byteoffset) {
+        return byteoffset;
+    }
+    if (byteoffset > incharcount) {
+        byteoffset = incharcount;
+    }
+    return measure_utf8(inbuf,byteoffset,0);
+}
+
+// When the scanner runs on its own thread its
+// diagnostics are collected here for the output stage.
+static vector<diag> *scansink = 0;
+
+// --baseline=<f> suppresses findings listed in f and
+// --write-baseline=<f> lists the current findings there.
+// An entry is a hash of the line's text with all the
+// whitespace dropped, the rule name and the path, so
+// entries still match after lines move or are reindented.
+// The baseline is loaded into an open addressing hash
+// table keyed on all three.  Each entry suppresses as
+// many findings as it was listed times.
+struct baseentry {
+    unsigned long long key;   // 0 means an empty slot.
+    unsigned count;
+};
+static vector<baseentry> basetable;
+static string writebasefile;
+struct newbaseentry {
+    unsigned long long hash;
+    unsigned rule;
+    string path;
+};
+static vector<newbaseentry> newbaseline;
+// The hash of the line in inbuf, computed at most once.
+static unsigned long long linehash = 0;
+static bool linehashvalid = false;
+
+static unsigned long long
+fnv1a(unsigned long long h, const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+    for (i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+#define FNVBASIS 0xcbf29ce484222325ULL
+
+static unsigned long long
+content_hash(unsigned rule)
+{
+    unsigned char norm[OURBUFSIZ+1];
+    unsigned n = 0;
+    unsigned i = 0;
+
+    if (rule == R_TRAILINGBLANK || rule == R_NOTTEXT) {
+        // Not about any one line.
+        return FNVBASIS;
+    }
+    if (linehashvalid) {
+        return linehash;
+    }
+    for (i = 0; i < incharcount; ++i) {
+        unsigned char c = inbuf[i];
+
+        if (c != ' ' && c != '\t' && c != '\v' && c != '\r' &&
+            c != '\n') {
+            norm[n++] = c;
+        }
+    }
+    linehash = fnv1a(FNVBASIS,norm,n);
+    linehashvalid = true;
+    return linehash;
+}
+
+static unsigned long long
+base_key(unsigned long long hash, unsigned rule, const string &path)
+{
+    unsigned long long k = fnv1a(hash,
+        (const unsigned char *)rulenames[rule],
+        strlen(rulenames[rule]));
+
+    k = fnv1a(k,(const unsigned char *)path.data(),path.size());
+    return k? k: 1;
+}
+
+static baseentry *
+base_find(unsigned long long key)
+{
+    size_t mask = basetable.size()-1;
+    size_t i = key & mask;
+
+    while (basetable[i].key && basetable[i].key != key) {
+        i = (i+1) & mask;
+    }
+    return &basetable[i];
+}
+
+static void
+load_baseline(const string &name)
+{
+    ifstream ist(name.c_str());
+    vector<unsigned long long> keys;
+    string text;
+    size_t size = 16;
+    unsigned i = 0;
+
+    if (!ist) {
+        cout << "Cannot open " << name << endl;
+        exit(1);
+    }
+    // Lines are: hash rule path
+    while (std::getline(ist,text)) {
+        size_t sp1 = text.find(' ');
+        size_t sp2 = (sp1 == string::npos)? sp1:
+            text.find(' ',sp1+1);
+        if (sp2 == string::npos) {
+            continue;
+        }
+        string rule = text.substr(sp1+1,sp2-sp1-1);
+        unsigned r = 0;
+
+        for (r = 0; r < R_COUNT; ++r) {
+            if (rule == rulenames[r]) {
+                break;
             }
-            break;
         }
-        case '\'':
-            if (incomment) {
-                if (blankline) {
-                    curlineindent = inpos;
+        if (r == R_COUNT) {
+            continue;
+        }
+        keys.push_back(base_key(
+            strtoull(text.c_str(),0,16),r,text.substr(sp2+1)));
+    }
+    // Keep the table at most half full.
+    while (size < keys.size()*2) {
+        size *= 2;
+    }
+    basetable.assign(size,baseentry());
+    for (i = 0; i < keys.size(); ++i) {
+        baseentry *e = base_find(keys[i]);
+
+        e->key = keys[i];
+        e->count++;
+    }
+}
+
+static bool
+newbase_less(const newbaseentry &a, const newbaseentry &b)
+{
+    if (a.path != b.path) {
+        return a.path < b.path;
+    }
+    if (a.rule != b.rule) {
+        return a.rule < b.rule;
+    }
+    return a.hash < b.hash;
+}
+
+static void
+write_baseline()
+{
+    ofstream out(writebasefile.c_str());
+    unsigned i = 0;
+    char hex[20];
+
+    if (!out) {
+        cout << "Cannot open " << writebasefile << endl;
+        exit(1);
+    }
+    std::sort(newbaseline.begin(),newbaseline.end(),newbase_less);
+    for (i = 0; i < newbaseline.size(); ++i) {
+        newbaseentry &e = newbaseline[i];
+
+        snprintf(hex,sizeof(hex),"%016llx",e.hash);
+        out << hex << " " << rulenames[e.rule] << " " <<
+            e.path << endl;
+    }
+}
+
+// True if the baseline says to say nothing about this.
+static bool
+suppressed(unsigned rule, const string &path)
+{
+    unsigned long long hash = 0;
+
+    if (basetable.empty() && writebasefile.empty()) {
+        return false;
+    }
+    hash = content_hash(rule);
+    if (!writebasefile.empty()) {
+        newbaseentry e;
+
+        e.hash = hash;
+        e.rule = rule;
+        e.path = path;
+        newbaseline.push_back(e);
+    }
+    if (basetable.empty()) {
+        return false;
+    }
+    baseentry *e = base_find(base_key(hash,rule,path));
+    if (!e->count) {
+        return false;
+    }
+    if (!lspmode) {
+        // The LSP server rescans lines again and again.
+        e->count--;
+    }
+    return true;
+}
+
+// All diagnostics come through here.
+// Returns false if the baseline suppressed it.
+static bool
+report(unsigned rule, unsigned line, const string &path,
+    unsigned col = 0, unsigned v1 = 0, unsigned v2 = 0)
+{
+    if (suppressed(rule,path)) {
+        return false;
+    }
+    diag d;
+    d.rule = rule;
+    d.line = line;
+    d.col = column_of(col);
+    d.v1 = v1;
+    d.v2 = v2;
+    if (scansink) {
+        scansink->push_back(d);
+        return true;
+    }
+    emit_diag(d,path);
+    return true;
+}
+
+// --trace=<file> writes Chrome trace-event JSON, which
+// Perfetto and chrome://tracing can show.  Each thread
+// appends spans to its own buffer with no locking; a
+// thread claims a buffer with one atomic increment.
+// The buffers are only read after all threads finish.
+// A buffer holds at most TRACEEVENTS events and later
+// ones are dropped, so tracing a huge tar archive or
+// file list does not grow without limit.
+#define TRACETHREADS 8
+#define TRACEEVENTS (1024*1024)
+struct traceevent {
+    const char   *name;
+    const string *path;
+    unsigned long long start; // Nanoseconds since tracebase.
+    unsigned long long end;
+};
+struct tracebuf {
+    const char *threadname;
+    vector<traceevent> events;
+};
+static bool tracing = false;
+static string tracefile;
+static tracebuf tracebufs[TRACETHREADS];
+static std::atomic<unsigned> tracethreads(0);
+static thread_local tracebuf *mytrace = 0;
+static std::chrono::steady_clock::time_point tracebase =
+    std::chrono::steady_clock::now();
+
+static void
+trace_thread(const char *name)
+{
+    if (!tracing) {
+        return;
+    }
+    unsigned n = tracethreads.fetch_add(1);
+    if (n >= TRACETHREADS) {
+        // Too many threads, this one goes untraced.
+        return;
+    }
+    mytrace = &tracebufs[n];
+    mytrace->threadname = name;
+    mytrace->events.reserve(4096);
+}
+
+// True if this thread's trace events are being kept.
+static bool
+trace_room()
+{
+    return mytrace && mytrace->events.size() < TRACEEVENTS;
+}
+
+static unsigned long long
+trace_begin()
+{
+    if (!mytrace) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - tracebase).count();
+}
+
+static void
+trace_end(const char *name, const string *path,
+    unsigned long long start)
+{
+    if (!trace_room()) {
+        return;
+    }
+    traceevent e;
+    e.name = name;
+    e.path = path;
+    e.start = start;
+    e.end = trace_begin();
+    mytrace->events.push_back(e);
+}
+
+static void
+json_string(std::ostream &out, const string &str)
+{
+    unsigned i = 0;
+
+    out << '"';
+    for (i = 0; i < str.size(); ++i) {
+        unsigned char c = str[i];
+
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            char hex[8];
+
+            snprintf(hex,sizeof(hex),"\\u%04x",c);
+            out << hex;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+static void
+write_trace()
+{
+    ofstream out(tracefile.c_str());
+    unsigned n = tracethreads.load();
+    unsigned t = 0;
+    const char *sep = "\n";
+
+    if (!out) {
+        cout << "Cannot open trace file " << tracefile << endl;
+        exit(1);
+    }
+    if (n > TRACETHREADS) {
+        n = TRACETHREADS;
+    }
+    out << "{\"traceEvents\":[";
+    out << std::fixed << std::setprecision(3);
+    for (t = 0; t < n; ++t) {
+        tracebuf &tb = tracebufs[t];
+        unsigned i = 0;
+
+        out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":1,\"tid\":" << t+1 <<
+            ",\"args\":{\"name\":\"" << tb.threadname << "\"}}";
+        sep = ",\n";
+        for (i = 0; i < tb.events.size(); ++i) {
+            traceevent &e = tb.events[i];
+
+            out << sep << "{\"name\":\"" << e.name <<
+                "\",\"cat\":\"dicheck\",\"ph\":\"X\",\"ts\":" <<
+                e.start/1000.0 << ",\"dur\":" <<
+                (e.end - e.start)/1000.0 <<
+                ",\"pid\":1,\"tid\":" << t+1;
+            if (e.path) {
+                out << ",\"args\":{\"file\":";
+                json_string(out,*e.path);
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}" << endl;
+}
+
+// Everything the scanner carries from one line
+// of a file to the next.
+struct scanstate {
+    unsigned line;
+    unsigned lastlineindent;
+    unsigned current_blankline_count;
+    unsigned sequential_blankline_count;
+    bool     found_nonblank;
+    bool     lastlinemacro;
+    bool     incomment;
+    bool     gaveup;
+    // bsb stands for brace space brace
+    // as in
+    //     }
+    // blankline
+    //     }
+    //suggesting the blankline is pointless.
+    int      bsb[2];
+};
+
+static void
+resetbsb(scanstate &st)
+{
+    st.bsb[0] = -1;
+    st.bsb[1] = -1;
+}
+static void
+newbsbblank(scanstate &st, int line)
+{
+    if (st.bsb[0] != -1) {
+        st.bsb[1] = line;
+    }
+}
+static void
+newbsbbrace(scanstate &st, int line, const string &path)
+{
+    int *bsb = st.bsb;
+
+    if (bsb[0] == -1) {
+        bsb[0] = line;
+        return;
+    }
+    if (bsb[1] != -1) {
+        if (line == (bsb[1]+1)) {
+            if (line == (bsb[0]+2)) {
+                report(R_BLANKBRACE,line,path);
+            }
+        }
+    }
+    resetbsb(st);
+    bsb[0] = line;
+}
+
+static bool
+lastnmatch(const char *test_string,
+    int curpos)
+{
+    int testlen = strlen(test_string);
+
+    if (testlen > curpos) {
+        return false;
+    }
+    int startindex = curpos-testlen;
+    if (strncmp(test_string,
+        (const char *)(inbuf+startindex),testlen)) {
+        return false;
+    }
+    return true;
+}
+
+const char *pdebug = "printf";
+const char *pflush = "fflush";
+static bool
+is_debug_line(const char * line)
+{
+    if (!strncmp((const char *)inbuf,pdebug,6)) {
+        return true;
+    }
+    if (!strncmp((const char *)inbuf,pflush,6)) {
+        return true;
+    }
+    return false;
+}
+
+static void
+process_a_line(scanstate &st, const string &path)
+{
+    int       line = st.line;
+    bool&     incomment = st.incomment;
+    bool&     lastlinemacro = st.lastlinemacro;
+    bool&     found_nonblank_ever = st.found_nonblank;
+    unsigned& lastlineindent = st.lastlineindent;
+    unsigned& current_blankline_count = st.current_blankline_count;
+    unsigned& sequential_blankline_count =
+        st.sequential_blankline_count;
+    unsigned char c = 0;
+    bool leadingchar = false;
+    char leadingcharv = ' ';
+    bool curlinemacro  = false;
+    bool blankline     = true;
+    bool inquotes = false;
+    bool insquote = false;
+    bool trailingwhitespace = false;
+    bool onelinecomment = false; // Meaning C++ comment.
+    int  curlineindent = 0;
+
+    if (is_debug_line((const char *)inbuf)) {
+        report(R_DEBUGPRINTF,line,path);
+    }
+    for (inpos = 0 ; inpos < incharcount ; ++inpos) {
+        c = inbuf[inpos];
+        bool onquoteterminator = false;
+
+        if (c == '\n') {
+            if (!leadingchar) {
+                newbsbblank(st,line);
+            } else if (leadingcharv == '}') {
+                newbsbbrace(st,line,path);
+            }
+        } else if (!leadingchar && c != ' ') {
+            leadingchar = true;
+            leadingcharv =  c;
+        }
+        switch(c) {
+        case ' ':
+            if (inquotes || insquote) {
+                break;
+            }
+            trailingwhitespace += 1;
+            break;
+        case '\n': {
+            bool saidleadingblank = false;
+
+            if (inquotes || insquote) {
+                report(R_NOQUOTEEND,line,path);
+            }
+            if (blankline) {
+                newbsbblank(st,line);
+                if (!found_nonblank_ever) {
+                    report(R_LEADINGBLANK,line,path);
+                    saidleadingblank = true;
+                }
+            } else {
+                current_blankline_count = 0;
+            }
+            if (curlineindent%indentamount) {
+                if (incomment && (curlineindent <= 3)) {
+                    // For our copyright and other comment blocks.
+                    if (!saidleadingblank && showtrailingspaces &&
+                        trailingwhitespace) {
+                        if (report(R_TRAILINGSPACE,line,path,
+                            inpos,trailingwhitespace)) {
+                            errcount++;
+                        }
+                    }
+                    break;
+                }
+                if (report(R_BADINDENT,line,path,curlineindent)) {
+                    errcount++;
+                }
+            } else {
+                if (curlineindent == lastlineindent) {
+                    // OK.
+                } else if ( curlineindent < lastlineindent) {
+                    if (!blankline && !curlinemacro) {
+                        // OK. we allow skipping back a
+                        // fair amount due to function
+                        // calls adding nesting.
+                        lastlineindent = curlineindent;
+                    }
+                } else if ( (curlineindent >= indentamount) &&
+                    (((curlineindent - indentamount) ==
+                        lastlineindent) ||
+                    (lastlinemacro)) ) {
+                    // lastline macro means ignore the indent
+                    // of the macro in the last line.
+                    // This is not a great fit with python :-)
+                    lastlineindent = curlineindent;
+                    // OK.
+                } else {
+                    if (report(R_INDENTCHANGE,line,path,inpos,
+                        lastlineindent,curlineindent)) {
+                        errcount++;
+                    }
+                }
+            }
+            lastlinemacro = curlinemacro;
+
+            if (!saidleadingblank && showtrailingspaces &&
+                trailingwhitespace) {
+                if (report(R_TRAILINGSPACE,line,path,
+                    inpos,trailingwhitespace)) {
+                    errcount++;
+                }
+            }
+            if (checklinelength) {
+                /*  Let the initial few lines run over,
+                    they are copyright notices. */
+                unsigned length = inpos;
+
+                if (columnmode != COL_BYTES) {
+                    length = linecolumns;
+                }
+                if (length > maxlinelength &&
+                    line > 6) {
+                    report(R_LINELENGTH,line,path,inpos,length);
+                }
+            }
+            trailingwhitespace = 0;
+            if (!blankline && !curlinemacro) {
+                lastlineindent = curlineindent;
+            }
+            break;
+        }
+        case '\'':
+            if (incomment) {
+                if (blankline) {
+                    curlineindent = inpos;
                     blankline = false;
                 }
                 trailingwhitespace = 0;
@@ -411,8 +1351,7 @@ process_a_line(int line,
             trailingwhitespace += 1;
             break;
         case '\t':
-            cout << line << ":" << inpos << " of " << path <<
-                " is a tab. " << endl;
+            report(R_TAB,line,path,inpos);
             if (inquotes || insquote) {
                 break;
             }
@@ -430,143 +1369,1705 @@ process_a_line(int line,
                 }
                 break;
             }
-            if (pythonsource) {
-                onelinecomment = true;
-                if (blankline) {
-                    curlineindent = inpos;
-                    blankline = false;
-                }
+            if (pythonsource) {
+                onelinecomment = true;
+                if (blankline) {
+                    curlineindent = inpos;
+                    blankline = false;
+                }
+                break;
+            } else if (blankline) {
+                // Macro of some kind. Indent 0 ok.
+                // Do not count this indent, really.
+                curlinemacro = true;
+                blankline = false;
+            }
+            break;
+        default:
+            trailingwhitespace = 0;
+            if (blankline) {
+                curlineindent = inpos;
+                blankline = false;
+            }
+            if (onelinecomment || incomment) {
+                break;
+            }
+            if (inquotes || insquote) {
+                break;
+            }
+            if (curlinemacro) {
+                break;
+            }
+            break;
+        } // End switch on character
+        if (!incomment && !onelinecomment &&
+            !onquoteterminator && !inquotes) {
+            if (lastnmatch("if  ",inpos)) {
+                report(R_IFTWOSPACE,line,path,inpos);
+            } else if (lastnmatch("if(",inpos)) {
+                report(R_IFNOSPACE,line,path,inpos);
+            } else if (lastnmatch("for(",inpos)) {
+                report(R_FORNOSPACE,line,path,inpos);
+            } else if (lastnmatch("for  ",inpos)) {
+                report(R_FORTWOSPACE,line,path,inpos);
+            }
+        }
+    }
+    if (summarymode) {
+        unsigned length = incharcount;
+
+        if (length && inbuf[length-1] == '\n') {
+            --length;
+        }
+        if (columnmode != COL_BYTES) {
+            length = linecolumns;
+        }
+        summary_line(length,blankline,curlineindent);
+    }
+    if (blankline) {
+        ++current_blankline_count;
+        ++ sequential_blankline_count;
+    } else {
+        current_blankline_count = 0;
+        found_nonblank_ever = true;
+        sequential_blankline_count = 0;
+    }
+}
+
+static void
+scan_begin(scanstate &st)
+{
+    memset(&st,0,sizeof(st));
+    st.line = 1;
+    resetbsb(st);
+}
+
+// len includes the newline, if the line has one.
+static void
+scan_line(scanstate &st, const string &path,
+    const char *p, unsigned len)
+{
+    if (st.gaveup) {
+        return;
+    }
+    if (len > OURBUFSIZ) {
+        report(R_NOTTEXT,st.line,path);
+        st.gaveup = true;
+        return;
+    }
+    memcpy(inbuf,p,len);
+    inbuf[len] = 0;
+    incharcount = len;
+    linehashvalid = false;
+    if (inbuf[len-1] != '\n') {
+        // Non-terminated last line
+        report(R_NONEWLINE,st.line,path);
+    }
+    if (columnmode != COL_BYTES) {
+        unsigned n = len;
+
+        if (inbuf[n-1] == '\n') {
+            --n;
+        }
+        linecolumns = measure_utf8(inbuf,n,&linebadutf8);
+        if (linebadutf8 >= 0) {
+            report(R_BADUTF8,st.line,path,linebadutf8);
+        }
+    }
+    process_a_line(st,path);
+    if (st.sequential_blankline_count > 1) {
+        report(R_BLANKLINES,st.line,path,0,
+            st.sequential_blankline_count);
+    }
+    ++st.line;
+}
+
+// text holds whole lines, except that the last
+// line of a file may have no newline.
+static void
+scan_text(scanstate &st, const string &path,
+    const char *text, size_t len)
+{
+    const char *end = text + len;
+
+    while (text < end) {
+        const char *nl = (const char *)
+            memchr(text,'\n',end-text);
+        const char *next = nl? nl+1: end;
+
+        scan_line(st,path,text,next-text);
+        text = next;
+    }
+}
+
+// Returns the number of lines in the file.
+static unsigned
+scan_end(scanstate &st, const string &path)
+{
+    if (!st.gaveup && st.current_blankline_count > 0) {
+        report(R_TRAILINGBLANK,st.line-1,path,0,
+            st.current_blankline_count);
+    }
+    return st.line-1;
+}
+
+// Hands out the text of a stream in pieces that hold
+// only whole lines (apart from an unterminated last
+// line) so the scanner never sees a line split.
+#define READCHUNK (64*1024)
+struct linereader {
+    std::istream *in;
+    string carry;
+    unsigned long long left;  // Bytes we may still read.
+};
+
+static bool
+read_lines(linereader &lr, string &out)
+{
+    char buf[READCHUNK];
+
+    out.swap(lr.carry);
+    lr.carry.clear();
+    while (lr.left) {
+        size_t want = lr.left < sizeof(buf)? lr.left: sizeof(buf);
+
+        if (!lr.in->read(buf,want) && !lr.in->gcount()) {
+            break;
+        }
+        size_t n = lr.in->gcount();
+        lr.left -= n;
+        const char *nl = (const char *)memrchr(buf,'\n',n);
+
+        if (!nl) {
+            out.append(buf,n);
+            if (out.size() > OURBUFSIZ) {
+                // Not text. Let the scanner say so.
+                return true;
+            }
+            continue;
+        }
+        size_t whole = nl - buf + 1;
+        out.append(buf,whole);
+        lr.carry.assign(nl+1,n-whole);
+        return true;
+    }
+    return !out.empty();
+}
+
+static void
+emit_diags(vector<diag> &diags, const string &path)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < diags.size(); ++i) {
+        emit_diag(diags[i],path);
+    }
+    diags.clear();
+}
+
+// Returns the number of lines in the file.
+// Each piece of the file is read, then scanned,
+// then its diagnostics are printed.
+// At most length bytes of mystream are read.
+static unsigned
+processfile(const string &path, std::istream * mystream,
+    unsigned long long length = ~0ULL)
+{
+    scanstate st;
+    linereader lr;
+    string text;
+    vector<diag> diags;
+    unsigned lines = 0;
+    unsigned long long t = 0;
+
+    lr.in = mystream;
+    lr.left = length;
+    scan_begin(st);
+    for (;;) {
+        t = trace_begin();
+        bool more = read_lines(lr,text);
+        trace_end("read",&path,t);
+        t = trace_begin();
+        scansink = &diags;
+        if (more) {
+            scan_text(st,path,text.data(),text.size());
+        } else {
+            lines = scan_end(st,path);
+        }
+        scansink = 0;
+        trace_end("scan",&path,t);
+        t = trace_begin();
+        emit_diags(diags,path);
+        trace_end("report",&path,t);
+        if (!more) {
+            break;
+        }
+    }
+    return lines;
+}
+
+// Shard output marks the start of each file's
+// diagnostics with its position on the command line
+// so --merge can put things back in single-run order.
+static const char *shardmark = "==> ";
+
+// Greedy bin-packing, biggest file first, into the
+// least loaded shard.  Ties are broken by path and
+// by shard number so every machine computes the
+// same partition from the same file list.
+struct shardfile {
+    unsigned index;
+    unsigned long long size;
+    const string *path;
+};
+
+static bool
+shard_order(const shardfile &a, const shardfile &b)
+{
+    if (a.size != b.size) {
+        return a.size > b.size;
+    }
+    return *a.path < *b.path;
+}
+
+static void
+select_shard(vector<string> &files, vector<bool> &selected)
+{
+    vector<shardfile> sf;
+    vector<unsigned long long> load(shardcount,0);
+    unsigned i = 0;
+
+    selected.assign(files.size(),false);
+    for (i = 0; i < files.size(); ++i) {
+        shardfile s;
+        struct stat st;
+
+        s.index = i;
+        s.path = &files[i];
+        // Unstatable files still land in some shard,
+        // which then reports them as Cannot open.
+        s.size = stat(files[i].c_str(),&st)? 0: st.st_size;
+        sf.push_back(s);
+    }
+    std::sort(sf.begin(),sf.end(),shard_order);
+    for (i = 0; i < sf.size(); ++i) {
+        unsigned best = 0;
+        unsigned b = 1;
+
+        for ( ; b < shardcount; ++b) {
+            if (load[b] < load[best]) {
+                best = b;
+            }
+        }
+        // Count every file as at least one byte so
+        // empty files spread out too.
+        load[best] += sf[i].size + 1;
+        if (best == shardindex) {
+            selected[sf[i].index] = true;
+        }
+    }
+}
+
+static void
+parse_shard(const char *fp)
+{
+    char *endptr = 0;
+    const char *numval = fp+8;
+
+    shardindex = strtoul(numval,&endptr,10);
+    if (endptr == numval || *endptr != '/') {
+        cout << " Option --shard= must be --shard=K/N" << endl;
+        exit(1);
+    }
+    numval = endptr+1;
+    shardcount = strtoul(numval,&endptr,10);
+    if (endptr == numval || *endptr ||
+        shardindex < 1 || shardindex > shardcount) {
+        cout << " Option --shard=K/N needs 1 <= K <= N" << endl;
+        exit(1);
+    }
+    // Internally shards count from zero.
+    --shardindex;
+}
+
+// Output side bookkeeping at the start and end of a file.
+static void
+begin_file(unsigned index, const string &path, bool marks)
+{
+    if (marks) {
+        cout << shardmark << index << " " << path << endl;
+    }
+    if (summarymode) {
+        summary_newfile(path);
+    }
+}
+
+static void
+end_file(unsigned lines)
+{
+    if (summarymode) {
+        summaryfiles.back().lines = lines;
+    }
+}
+
+// "-" means standard input.
+static std::istream *
+open_input(const string &path, ifstream &ist)
+{
+    if (path == "-") {
+        return &cin;
+    }
+    ist.open(path.c_str());
+    if (!ist) {
+        return 0;
+    }
+    return &ist;
+}
+
+// For --tar.  Reads plain ustar, pax and GNU tar
+// streams one 512 byte block at a time and hands each
+// regular member straight to the scanner, so memory
+// use does not depend on the archive size.
+#define TARBLOCK 512
+#define PAXMAX (1024*1024) /* Larger pax headers are ignored */
+
+// Octal, or GNU base-256 for big values.
+static unsigned long long
+tar_number(const char *p, unsigned len)
+{
+    unsigned long long v = 0;
+    unsigned i = 0;
+
+    if ((unsigned char)p[0] & 0x80) {
+        v = (unsigned char)p[0] & 0x7f;
+        for (i = 1; i < len; ++i) {
+            v = (v << 8) | (unsigned char)p[i];
+        }
+        return v;
+    }
+    while (i < len && (p[i] == ' ' || p[i] == 0)) {
+        ++i;
+    }
+    for ( ; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+        v = (v << 3) | (p[i] - '0');
+    }
+    return v;
+}
+
+static bool
+tar_checksum_ok(const char *hdr)
+{
+    unsigned long sum = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < TARBLOCK; ++i) {
+        // The checksum field counts as spaces.
+        sum += (i >= 148 && i < 156)? ' ': (unsigned char)hdr[i];
+    }
+    return sum == tar_number(hdr+148,8);
+}
+
+static string
+tar_field(const char *p, unsigned len)
+{
+    return string(p,strnlen(p,len));
+}
+
+// Returns the path= value of a pax extended header.
+static string
+pax_path(const string &data)
+{
+    size_t pos = 0;
+
+    // Records are "length key=value\n".
+    while (pos < data.size()) {
+        char *endptr = 0;
+        unsigned long len = strtoul(data.c_str()+pos,&endptr,10);
+        size_t sp = endptr - data.c_str();
+
+        if (!len || sp >= data.size() || pos+len > data.size()) {
+            break;
+        }
+        if (!data.compare(sp,6," path=")) {
+            return data.substr(sp+6,pos+len-1-(sp+6));
+        }
+        pos += len;
+    }
+    return string();
+}
+
+static void
+tar_truncated(const string &tarname)
+{
+    cout << tarname << " is not a complete tar archive" << endl;
+    exit(1);
+}
+
+// Skips n bytes of the archive, all of which must be
+// there.  ignore() only sets eofbit on a short skip.
+static void
+tar_skip(const string &tarname, std::istream *in,
+    unsigned long long n)
+{
+    if (!n) {
+        return;
+    }
+    in->ignore(n);
+    if ((unsigned long long)in->gcount() != n) {
+        tar_truncated(tarname);
+    }
+}
+
+static void
+check_tar(unsigned index, const string &tarname, std::istream *in,
+    bool marks)
+{
+    char hdr[TARBLOCK];
+    unsigned zeroblocks = 0;
+    string longname;
+    string paxname;
+    static std::deque<string> tracenames;
+
+    while (in->read(hdr,TARBLOCK)) {
+        if (hdr[0] == 0 && !memcmp(hdr,hdr+1,TARBLOCK-1)) {
+            // Two zero blocks end the archive.
+            if (++zeroblocks == 2) {
+                return;
+            }
+            continue;
+        }
+        zeroblocks = 0;
+        if (!tar_checksum_ok(hdr)) {
+            cout << tarname << " is not a tar archive "
+                "or is corrupt" << endl;
+            exit(1);
+        }
+        unsigned long long size = tar_number(hdr+124,12);
+        unsigned long long pad = (TARBLOCK - size%TARBLOCK) %
+            TARBLOCK;
+        char type = hdr[156];
+        string data;
+
+        switch(type) {
+        case 'x':
+        case 'L':
+            if (size > PAXMAX) {
+                tar_skip(tarname,in,size+pad);
+                break;
+            }
+            data.resize(size);
+            if (size && !in->read(&data[0],size)) {
+                tar_truncated(tarname);
+            }
+            tar_skip(tarname,in,pad);
+            if (type == 'x') {
+                paxname = pax_path(data);
+            } else {
+                longname = tar_field(data.data(),data.size());
+            }
+            continue;
+        case '0':
+        case '\0':
+        case '7': {
+            string name;
+
+            if (!paxname.empty()) {
+                name = paxname;
+            } else if (!longname.empty()) {
+                name = longname;
+            } else {
+                // Old GNU headers ("ustar  ") keep times
+                // where POSIX ustar has the name prefix.
+                if (!memcmp(hdr+257,"ustar",6)) {
+                    name = tar_field(hdr+345,155);
+                }
+                if (!name.empty()) {
+                    name += "/";
+                }
+                name += tar_field(hdr,100);
+            }
+            // Trace events point at their file names,
+            // which are kept only while events are.
+            bool keep = trace_room();
+            if (keep) {
+                tracenames.push_back(name);
+            }
+            const string &path = keep? tracenames.back(): name;
+            unsigned long long t = trace_begin();
+
+            begin_file(index,path,marks);
+            end_file(processfile(path,in,size));
+            trace_end("file",&path,t);
+            if (in->eof()) {
+                // The member itself was cut short.
+                tar_truncated(tarname);
+            }
+            tar_skip(tarname,in,pad);
+            break;
+        }
+        default:
+            // Directories, links, global pax headers...
+            tar_skip(tarname,in,size+pad);
+            break;
+        }
+        longname.clear();
+        paxname.clear();
+    }
+    // Only the two zero blocks end an archive.
+    tar_truncated(tarname);
+}
+
+static void
+run_serial(vector<string> &files, vector<bool> &selected,
+    bool marks)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < files.size(); ++i) {
+        string &f = files[i];
+        if (!selected[i]) {
+            continue;
+        }
+        ifstream ist;
+        unsigned long long tfile = trace_begin();
+        unsigned long long t = tfile;
+        std::istream *in = open_input(f,ist);
+        trace_end("open",&f,t);
+        if (!in) {
+            cout << "Cannot open " << f << endl;
+            exit(1);
+        }
+        if (tarmode) {
+            check_tar(i,f,in,marks);
+        } else {
+            begin_file(i,f,marks);
+            end_file(processfile(f,in));
+        }
+        trace_end("file",&f,tfile);
+    }
+}
+
+// With --pipeline reading, scanning and output each
+// get a thread.  They pass batches of lines along
+// through bounded single producer, single consumer
+// rings.  A full ring makes the producer wait, an
+// empty one the consumer.  A waiting thread spins
+// for a little while, then sleeps until woken, so a
+// slow input such as a pipe costs no CPU.
+#define RINGSIZE 64 /* must be a power of two */
+#define RINGSPINS 100
+template <class T>
+struct spscring {
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    T *slots[RINGSIZE];
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<unsigned> sleepers;
+
+    spscring() : head(0), tail(0), sleepers(0) {}
+    template <class F>
+    void wait_until(F ready)
+    {
+        unsigned i = 0;
+
+        for (i = 0; i < RINGSPINS; ++i) {
+            if (ready()) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> held(lock);
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake.wait(held,ready);
+        sleepers.fetch_sub(1);
+    }
+    // Pairs with the fence in wait_until(): either the
+    // sleeper sees our update or we see the sleeper.
+    void wakeup()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> held(lock);
+
+            wake.notify_all();
+        }
+    }
+    void push(T *v)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+
+        wait_until([&]() {
+            return t - head.load(std::memory_order_acquire) <
+                RINGSIZE;
+        });
+        slots[t & (RINGSIZE-1)] = v;
+        tail.store(t+1,std::memory_order_release);
+        wakeup();
+    }
+    T *pop()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+
+        wait_until([&]() {
+            return tail.load(std::memory_order_acquire) != h;
+        });
+        T *v = slots[h & (RINGSIZE-1)];
+        head.store(h+1,std::memory_order_release);
+        wakeup();
+        return v;
+    }
+};
+
+// A piece of one file on its way through the pipeline.
+struct batch {
+    unsigned index;      // Position in the file list.
+    const string *path;
+    string text;         // Whole lines from the file.
+    vector<diag> diags;  // What the scanner found in text.
+    unsigned lines;      // Lines in the file, on the last batch.
+    bool first;
+    bool last;
+    bool openfailed;
+    bool endofinput;
+
+    batch() : index(0), path(0), lines(0), first(false),
+        last(false), openfailed(false), endofinput(false) {}
+};
+
+static spscring<batch> toscan;
+static spscring<batch> tooutput;
+static std::thread *readerthread = 0;
+static std::thread *scannerthread = 0;
+// Set to have the reader send endofinput early.
+static std::atomic<bool> stopreading(false);
+
+static void
+io_stage(vector<string> *files, vector<bool> *selected,
+    spscring<batch> *out)
+{
+    unsigned i = 0;
+
+    trace_thread("reader");
+    for (i = 0; i < files->size() && !stopreading; ++i) {
+        const string &f = (*files)[i];
+        if (!(*selected)[i]) {
+            continue;
+        }
+        ifstream ist;
+        unsigned long long t = trace_begin();
+        std::istream *in = open_input(f,ist);
+        trace_end("open",&f,t);
+        if (!in) {
+            batch *b = new batch;
+
+            b->index = i;
+            b->path = &f;
+            b->openfailed = true;
+            out->push(b);
+            break;
+        }
+        linereader lr;
+        bool more = true;
+        bool first = true;
+
+        lr.in = in;
+        lr.left = ~0ULL;
+        while (more && !stopreading) {
+            batch *b = new batch;
+
+            b->index = i;
+            b->path = &f;
+            t = trace_begin();
+            more = read_lines(lr,b->text);
+            trace_end("read",&f,t);
+            b->first = first;
+            b->last = !more;
+            first = false;
+            out->push(b);
+        }
+        if (more) {
+            // Stopped partway through.
+            break;
+        }
+    }
+    batch *b = new batch;
+    b->endofinput = true;
+    out->push(b);
+}
+
+static void
+scan_stage(spscring<batch> *in, spscring<batch> *out)
+{
+    scanstate st;
+    unsigned long long tfile = 0;
+
+    trace_thread("scanner");
+    for (;;) {
+        batch *b = in->pop();
+        unsigned long long t = 0;
+
+        if (b->endofinput || b->openfailed || stopreading) {
+            bool end = b->endofinput;
+
+            // b belongs to the output stage once pushed.
+            out->push(b);
+            if (end) {
+                return;
+            }
+            continue;
+        }
+        if (b->first) {
+            tfile = trace_begin();
+            scan_begin(st);
+        }
+        t = trace_begin();
+        scansink = &b->diags;
+        scan_text(st,*b->path,b->text.data(),b->text.size());
+        if (b->last) {
+            b->lines = scan_end(st,*b->path);
+        }
+        scansink = 0;
+        trace_end("scan",b->path,t);
+        if (b->last) {
+            trace_end("file",b->path,tfile);
+        }
+        string().swap(b->text);
+        out->push(b);
+    }
+}
+
+static void
+join_pipeline()
+{
+    readerthread->join();
+    scannerthread->join();
+    delete readerthread;
+    delete scannerthread;
+    readerthread = 0;
+    scannerthread = 0;
+}
+
+// Stops the reader and scanner and waits for them, so
+// the output stage can call exit(), which destroys the
+// globals they use.  Does nothing without --pipeline.
+static void
+stop_pipeline()
+{
+    if (!readerthread) {
+        return;
+    }
+    stopreading = true;
+    for (;;) {
+        batch *b = tooutput.pop();
+        bool end = b->endofinput;
+
+        delete b;
+        if (end) {
+            break;
+        }
+    }
+    join_pipeline();
+}
+
+static void
+run_pipeline(vector<string> &files, vector<bool> &selected,
+    bool marks)
+{
+    readerthread = new std::thread(io_stage,&files,&selected,
+        &toscan);
+    scannerthread = new std::thread(scan_stage,&toscan,
+        &tooutput);
+
+    // This thread is the output stage.
+    for (;;) {
+        batch *b = tooutput.pop();
+        unsigned long long t = 0;
+
+        if (b->endofinput) {
+            delete b;
+            break;
+        }
+        if (b->openfailed) {
+            cout << "Cannot open " << *b->path << endl;
+            delete b;
+            stop_pipeline();
+            exit(1);
+        }
+        if (b->first) {
+            begin_file(b->index,*b->path,marks);
+        }
+        t = trace_begin();
+        emit_diags(b->diags,*b->path);
+        trace_end("report",b->path,t);
+        if (b->last) {
+            end_file(b->lines);
+        }
+        delete b;
+    }
+    join_pipeline();
+}
+
+// Adds the names in listfile, one per line, to files.
+static void
+read_file_list(const string &listfile, vector<string> &files)
+{
+    ifstream ist;
+    std::istream *in = open_input(listfile,ist);
+    string name;
+
+    if (!in) {
+        cout << "Cannot open " << listfile << endl;
+        exit(1);
+    }
+    while (std::getline(*in,name)) {
+        if (!name.empty()) {
+            files.push_back(name);
+        }
+    }
+}
+
+// --lsp runs dicheck as a Language Server on stdin
+// and stdout.  Each open document is kept as lines,
+// with the diagnostics of each line and a copy of the
+// scanner state every CHECKPOINTLINES lines.  After an
+// edit we rescan from the nearest checkpoint at or
+// before the first changed line and stop as soon as
+// the state matches a checkpoint of the previous scan
+// in the unchanged text that follows the edit.
+#define CHECKPOINTLINES 64
+
+// Just enough JSON for the messages we handle.
+enum jsontype { JNULL, JBOOL, JNUMBER, JSTRING, JARRAY, JOBJECT };
+struct jsonval {
+    jsontype type;
+    bool     b;
+    double   num;
+    string   str;
+    vector<jsonval> items;  // Array elements or object values.
+    vector<string>  keys;   // Object keys.
+
+    jsonval() : type(JNULL), b(false), num(0) {}
+    const jsonval *get(const char *key) const
+    {
+        unsigned i = 0;
+
+        for (i = 0; i < keys.size(); ++i) {
+            if (keys[i] == key) {
+                return &items[i];
+            }
+        }
+        return 0;
+    }
+};
+
+static void
+json_skipspace(const string &t, size_t &pos)
+{
+    while (pos < t.size() && (t[pos] == ' ' || t[pos] == '\t' ||
+        t[pos] == '\n' || t[pos] == '\r')) {
+        ++pos;
+    }
+}
+
+static void
+utf8_append(string &out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out.push_back(cp);
+    } else if (cp < 0x800) {
+        out.push_back(0xc0 | (cp >> 6));
+        out.push_back(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out.push_back(0xe0 | (cp >> 12));
+        out.push_back(0x80 | ((cp >> 6) & 0x3f));
+        out.push_back(0x80 | (cp & 0x3f));
+    } else {
+        out.push_back(0xf0 | (cp >> 18));
+        out.push_back(0x80 | ((cp >> 12) & 0x3f));
+        out.push_back(0x80 | ((cp >> 6) & 0x3f));
+        out.push_back(0x80 | (cp & 0x3f));
+    }
+}
+
+static bool
+json_hex4(const string &t, size_t &pos, unsigned long &v)
+{
+    unsigned i = 0;
+
+    if (pos + 4 > t.size()) {
+        return false;
+    }
+    v = 0;
+    for (i = 0; i < 4; ++i) {
+        char c = t[pos++];
+
+        v <<= 4;
+        if (c >= '0' && c <= '9') {
+            v |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            v |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+json_parse_string(const string &t, size_t &pos, string &out)
+{
+    // pos is just past the opening quote.
+    while (pos < t.size()) {
+        char c = t[pos++];
+        unsigned long cp = 0;
+
+        if (c == '"') {
+            return true;
+        }
+        if (c != '\\') {
+            out.push_back(c);
+            continue;
+        }
+        if (pos >= t.size()) {
+            return false;
+        }
+        c = t[pos++];
+        switch(c) {
+        case 'b':
+            out.push_back('\b');
+            break;
+        case 'f':
+            out.push_back('\f');
+            break;
+        case 'n':
+            out.push_back('\n');
+            break;
+        case 'r':
+            out.push_back('\r');
+            break;
+        case 't':
+            out.push_back('\t');
+            break;
+        case 'u':
+            if (!json_hex4(t,pos,cp)) {
+                return false;
+            }
+            if (cp >= 0xd800 && cp < 0xdc00 &&
+                pos + 6 <= t.size() && t[pos] == '\\' &&
+                t[pos+1] == 'u') {
+                unsigned long lo = 0;
+
+                pos += 2;
+                if (!json_hex4(t,pos,lo)) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) +
+                    (lo - 0xdc00);
+            }
+            utf8_append(out,cp);
+            break;
+        default:
+            out.push_back(c);
+            break;
+        }
+    }
+    return false;
+}
+
+// LSP messages nest only a few levels, so anything
+// deeper is rejected rather than risking the stack.
+#define JSONMAXDEPTH 64
+
+static bool
+json_parse(const string &t, size_t &pos, jsonval &v,
+    unsigned depth = 0)
+{
+    json_skipspace(t,pos);
+    if (pos >= t.size() || depth > JSONMAXDEPTH) {
+        return false;
+    }
+    char c = t[pos];
+    if (c == '{' || c == '[') {
+        char close = (c == '{')? '}': ']';
+
+        v.type = (c == '{')? JOBJECT: JARRAY;
+        ++pos;
+        json_skipspace(t,pos);
+        if (pos < t.size() && t[pos] == close) {
+            ++pos;
+            return true;
+        }
+        for (;;) {
+            if (v.type == JOBJECT) {
+                string key;
+
+                json_skipspace(t,pos);
+                if (pos >= t.size() || t[pos] != '"') {
+                    return false;
+                }
+                ++pos;
+                if (!json_parse_string(t,pos,key)) {
+                    return false;
+                }
+                json_skipspace(t,pos);
+                if (pos >= t.size() || t[pos] != ':') {
+                    return false;
+                }
+                ++pos;
+                v.keys.push_back(key);
+            }
+            v.items.push_back(jsonval());
+            if (!json_parse(t,pos,v.items.back(),depth+1)) {
+                return false;
+            }
+            json_skipspace(t,pos);
+            if (pos >= t.size()) {
+                return false;
+            }
+            if (t[pos] == ',') {
+                ++pos;
+                continue;
+            }
+            if (t[pos] == close) {
+                ++pos;
+                return true;
+            }
+            return false;
+        }
+    }
+    if (c == '"') {
+        v.type = JSTRING;
+        ++pos;
+        return json_parse_string(t,pos,v.str);
+    }
+    if (!t.compare(pos,4,"true")) {
+        v.type = JBOOL;
+        v.b = true;
+        pos += 4;
+        return true;
+    }
+    if (!t.compare(pos,5,"false")) {
+        v.type = JBOOL;
+        pos += 5;
+        return true;
+    }
+    if (!t.compare(pos,4,"null")) {
+        pos += 4;
+        return true;
+    }
+    char *endptr = 0;
+    v.type = JNUMBER;
+    v.num = strtod(t.c_str()+pos,&endptr);
+    if (endptr == t.c_str()+pos) {
+        return false;
+    }
+    pos = endptr - t.c_str();
+    return true;
+}
+
+// Only used to echo request ids back.
+static void
+json_write(std::ostream &out, const jsonval &v)
+{
+    if (v.type == JSTRING) {
+        json_string(out,v.str);
+    } else if (v.type == JNUMBER) {
+        out << (long long)v.num;
+    } else {
+        out << "null";
+    }
+}
+
+static unsigned
+json_uint(const jsonval *v)
+{
+    if (!v || v->type != JNUMBER || v->num < 0) {
+        return 0;
+    }
+    return (unsigned)v->num;
+}
+
+static const string &
+json_str(const jsonval *v)
+{
+    static const string empty;
+
+    if (!v || v->type != JSTRING) {
+        return empty;
+    }
+    return v->str;
+}
+
+struct checkpoint {
+    unsigned  line;  // Index of the next line to scan.
+    scanstate st;
+};
+
+struct lspdoc {
+    string path;
+    vector<string> lines;  // Each with its newline, if any.
+    vector<vector<diag> > linediags;
+    vector<checkpoint> checkpoints;
+    scanstate endstate;
+    vector<diag> published;
+};
+static std::map<string,lspdoc> lspdocs;
+
+// Line numbers in a state are absolute. When text
+// moves by delta lines so do the numbers.
+static void
+shift_state(scanstate &st, int delta)
+{
+    st.line += delta;
+    if (st.bsb[0] != -1) {
+        st.bsb[0] += delta;
+    }
+    if (st.bsb[1] != -1) {
+        st.bsb[1] += delta;
+    }
+}
+
+static int
+bsb_offset(const scanstate &st, int i)
+{
+    return st.bsb[i] == -1? -1: (int)st.line - st.bsb[i];
+}
+
+// True if scanning on from a and b gives the same
+// results, apart from line numbering.
+static bool
+same_state(const scanstate &a, const scanstate &b)
+{
+    return a.lastlineindent == b.lastlineindent &&
+        a.current_blankline_count == b.current_blankline_count &&
+        a.sequential_blankline_count ==
+            b.sequential_blankline_count &&
+        a.found_nonblank == b.found_nonblank &&
+        a.lastlinemacro == b.lastlinemacro &&
+        a.incomment == b.incomment &&
+        a.gaveup == b.gaveup &&
+        bsb_offset(a,0) == bsb_offset(b,0) &&
+        bsb_offset(a,1) == bsb_offset(b,1);
+}
+
+// Lines [lo,hi) of doc.lines are new, everything
+// before lo is as before and everything from hi on
+// is what used to follow the old text of the edit.
+static void
+relex(lspdoc &doc, unsigned lo, unsigned hi, unsigned oldcount)
+{
+    vector<checkpoint> &oldcps = doc.checkpoints;
+    vector<vector<diag> > &olddiags = doc.linediags;
+    vector<checkpoint> cps;
+    vector<vector<diag> > diags;
+    unsigned n = doc.lines.size();
+    int delta = (int)n - (int)oldcount;
+    unsigned c = 0;
+    unsigned oc = 0;
+    unsigned i = 0;
+    scanstate st;
+
+    while (c < oldcps.size() && oldcps[c].line <= lo) {
+        ++c;
+    }
+    if (c) {
+        --c;
+        st = oldcps[c].st;
+        i = oldcps[c].line;
+    } else {
+        scan_begin(st);
+    }
+    cps.assign(oldcps.begin(),oldcps.begin()+c);
+    diags.reserve(n);
+    for (unsigned k = 0; k < i; ++k) {
+        diags.push_back(vector<diag>());
+        diags.back().swap(olddiags[k]);
+    }
+    oc = c;
+    for ( ; i < n; ++i) {
+        if (i >= hi) {
+            unsigned j = i - delta;
+
+            while (oc < oldcps.size() && oldcps[oc].line < j) {
+                ++oc;
+            }
+            if (oc < oldcps.size() && oldcps[oc].line == j &&
+                same_state(st,oldcps[oc].st)) {
                 break;
-            } else if (blankline) {
-                // Macro of some kind. Indent 0 ok.
-                // Do not count this indent, really.
-                curlinemacro = true;
-                blankline = false;
             }
-            break;
-        default:
-            trailingwhitespace = 0;
-            if (blankline) {
-                curlineindent = inpos;
-                blankline = false;
+        }
+        if (cps.empty() || i - cps.back().line >= CHECKPOINTLINES) {
+            checkpoint cp;
+
+            cp.line = i;
+            cp.st = st;
+            cps.push_back(cp);
+        }
+        diags.push_back(vector<diag>());
+        scansink = &diags.back();
+        scan_line(st,doc.path,doc.lines[i].data(),
+            doc.lines[i].size());
+        scansink = 0;
+    }
+    if (i < n) {
+        // Converged, the rest is the old scan moved by delta.
+        unsigned j = i - delta;
+
+        for ( ; j < oldcount; ++j) {
+            vector<diag> &d = olddiags[j];
+
+            for (unsigned k = 0; k < d.size(); ++k) {
+                d[k].line += delta;
             }
-            if (onelinecomment || incomment) {
-                break;
+            diags.push_back(vector<diag>());
+            diags.back().swap(d);
+        }
+        for ( ; oc < oldcps.size(); ++oc) {
+            cps.push_back(oldcps[oc]);
+            cps.back().line += delta;
+            shift_state(cps.back().st,delta);
+        }
+        shift_state(doc.endstate,delta);
+    } else {
+        doc.endstate = st;
+    }
+    doc.checkpoints.swap(cps);
+    doc.linediags.swap(diags);
+}
+
+static void
+lsp_send(const string &body)
+{
+    cout << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    cout.flush();
+}
+
+// LSP columns count UTF-16 code units.
+static unsigned
+utf16_column(const string &line, unsigned bytes)
+{
+    unsigned units = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < bytes && i < line.size(); ++i) {
+        unsigned char c = line[i];
+
+        if ((c & 0xc0) == 0x80) {
+            continue;
+        }
+        units += (c >= 0xf0)? 2: 1;
+    }
+    return units;
+}
+
+static size_t
+utf16_to_bytes(const string &line, unsigned units)
+{
+    size_t len = line.size();
+    size_t i = 0;
+
+    if (len && line[len-1] == '\n') {
+        --len;
+    }
+    while (i < len && units) {
+        unsigned char c = line[i];
+        unsigned w = (c >= 0xf0)? 2: 1;
+
+        ++i;
+        while (i < len && ((unsigned char)line[i] & 0xc0) == 0x80) {
+            ++i;
+        }
+        units = (units > w)? units - w: 0;
+    }
+    return i;
+}
+
+static bool
+same_diags(const vector<diag> &a, const vector<diag> &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    return !a.size() || !memcmp(&a[0],&b[0],a.size()*sizeof(diag));
+}
+
+static void
+publish(const string &uri, lspdoc &doc)
+{
+    vector<diag> all;
+    std::ostringstream body;
+    unsigned i = 0;
+    scanstate end = doc.endstate;
+    vector<diag> enddiags;
+
+    for (i = 0; i < doc.linediags.size(); ++i) {
+        all.insert(all.end(),doc.linediags[i].begin(),
+            doc.linediags[i].end());
+    }
+    scansink = &enddiags;
+    scan_end(end,doc.path);
+    scansink = 0;
+    all.insert(all.end(),enddiags.begin(),enddiags.end());
+    if (same_diags(all,doc.published)) {
+        return;
+    }
+    doc.published.swap(all);
+    body << "{\"jsonrpc\":\"2.0\","
+        "\"method\":\"textDocument/publishDiagnostics\","
+        "\"params\":{\"uri\":";
+    json_string(body,uri);
+    body << ",\"diagnostics\":[";
+    for (i = 0; i < doc.published.size(); ++i) {
+        const diag &d = doc.published[i];
+        unsigned line = d.line? d.line-1: 0;
+        string empty;
+        const string &text = line < doc.lines.size()?
+            doc.lines[line]: empty;
+        unsigned start = utf16_column(text,d.col);
+        // No column means the whole line.
+        unsigned endline = d.col? line: line+1;
+        unsigned end = d.col? start+1: 0;
+        std::ostringstream msg;
+        string m;
+
+        format_diag(msg,d,doc.path);
+        m = msg.str();
+        while (!m.empty() && (m[m.size()-1] == '\n' ||
+            m[m.size()-1] == ' ')) {
+            m.resize(m.size()-1);
+        }
+        if (i) {
+            body << ",";
+        }
+        body << "{\"range\":{\"start\":{\"line\":" << line <<
+            ",\"character\":" << start << "},\"end\":{\"line\":" <<
+            endline << ",\"character\":" << end << "}},"
+            "\"severity\":2,\"source\":\"dicheck\",\"code\":\"" <<
+            rulenames[d.rule] << "\",\"message\":";
+        json_string(body,m);
+        body << "}";
+    }
+    body << "]}}";
+    lsp_send(body.str());
+}
+
+static void
+split_lines(const string &text, vector<string> &out)
+{
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+        size_t nl = text.find('\n',pos);
+        size_t next = (nl == string::npos)? text.size(): nl+1;
+
+        out.push_back(text.substr(pos,next-pos));
+        pos = next;
+    }
+}
+
+static string
+uri_to_path(const string &uri)
+{
+    string path;
+    size_t i = 0;
+
+    if (!uri.compare(0,7,"file://")) {
+        i = 7;
+    }
+    for ( ; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i+2 < uri.size()) {
+            path.push_back((char)strtoul(
+                uri.substr(i+1,2).c_str(),0,16));
+            i += 2;
+        } else {
+            path.push_back(uri[i]);
+        }
+    }
+    return path;
+}
+
+static void
+lsp_open(const jsonval &params)
+{
+    const jsonval *td = params.get("textDocument");
+    if (!td) {
+        return;
+    }
+    const string &uri = json_str(td->get("uri"));
+    lspdoc &doc = lspdocs[uri];
+
+    doc = lspdoc();
+    doc.path = uri_to_path(uri);
+    split_lines(json_str(td->get("text")),doc.lines);
+    relex(doc,0,doc.lines.size(),0);
+    publish(uri,doc);
+}
+
+// Apply one content change to doc.lines.  lo and hi
+// track the span of lines that are not known to be
+// unchanged, in terms of the current lines.
+static void
+apply_change(lspdoc &doc, const jsonval &change,
+    unsigned &lo, unsigned &hi)
+{
+    const jsonval *range = change.get("range");
+    const string &text = json_str(change.get("text"));
+    vector<string> &lines = doc.lines;
+    vector<string> repl;
+
+    if (!range) {
+        lines.clear();
+        split_lines(text,lines);
+        lo = 0;
+        hi = lines.size();
+        return;
+    }
+    const jsonval *s = range->get("start");
+    const jsonval *e = range->get("end");
+    if (!s || !e) {
+        return;
+    }
+    unsigned sl = json_uint(s->get("line"));
+    unsigned el = json_uint(e->get("line"));
+    string empty;
+    if (sl > lines.size()) {
+        sl = lines.size();
+    }
+    if (el > lines.size()) {
+        el = lines.size();
+    }
+    if (el < sl) {
+        el = sl;
+    }
+    const string &first = sl < lines.size()? lines[sl]: empty;
+    const string &last = el < lines.size()? lines[el]: empty;
+    string joined = first.substr(0,
+        utf16_to_bytes(first,json_uint(s->get("character"))));
+    joined += text;
+    joined += last.substr(
+        utf16_to_bytes(last,json_uint(e->get("character"))));
+    split_lines(joined,repl);
+
+    // Lines sl..el (el may be one past the end) are replaced.
+    unsigned removed = (el < lines.size()? el+1: el) - sl;
+    int delta = (int)repl.size() - (int)removed;
+    lines.erase(lines.begin()+sl,lines.begin()+sl+removed);
+    lines.insert(lines.begin()+sl,repl.begin(),repl.end());
+    if (lo > sl) {
+        lo = sl;
+    }
+    if (hi > sl+removed) {
+        hi += delta;
+    } else if (hi > sl) {
+        hi = sl;
+    }
+    if (hi < sl + repl.size()) {
+        hi = sl + repl.size();
+    }
+}
+
+static void
+lsp_change(const jsonval &params)
+{
+    const jsonval *td = params.get("textDocument");
+    const jsonval *changes = params.get("contentChanges");
+    if (!td || !changes) {
+        return;
+    }
+    const string &uri = json_str(td->get("uri"));
+    std::map<string,lspdoc>::iterator it = lspdocs.find(uri);
+    if (it == lspdocs.end()) {
+        return;
+    }
+    lspdoc &doc = it->second;
+    unsigned oldcount = doc.lines.size();
+    unsigned lo = oldcount;
+    unsigned hi = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < changes->items.size(); ++i) {
+        apply_change(doc,changes->items[i],lo,hi);
+    }
+    if (lo > hi) {
+        // Nothing changed.
+        return;
+    }
+    relex(doc,lo,hi,oldcount);
+    publish(uri,doc);
+}
+
+static void
+lsp_close(const jsonval &params)
+{
+    const jsonval *td = params.get("textDocument");
+    if (!td) {
+        return;
+    }
+    const string &uri = json_str(td->get("uri"));
+    std::ostringstream body;
+
+    lspdocs.erase(uri);
+    body << "{\"jsonrpc\":\"2.0\","
+        "\"method\":\"textDocument/publishDiagnostics\","
+        "\"params\":{\"uri\":";
+    json_string(body,uri);
+    body << ",\"diagnostics\":[]}}";
+    lsp_send(body.str());
+}
+
+static void
+lsp_reply(const jsonval &id, const char *result)
+{
+    std::ostringstream body;
+
+    body << "{\"jsonrpc\":\"2.0\",\"id\":";
+    json_write(body,id);
+    body << "," << result << "}";
+    lsp_send(body.str());
+}
+
+// Larger messages are skipped unread.
+#define LSPMAXMESSAGE (64*1024*1024)
+
+static void
+run_lsp()
+{
+    bool shutdown = false;
+
+    lspmode = true;
+    for (;;) {
+        string header;
+        size_t length = 0;
+        bool havelength = false;
+
+        while (std::getline(cin,header)) {
+            if (!header.empty() && header[header.size()-1] == '\r') {
+                header.resize(header.size()-1);
             }
-            if (inquotes || insquote) {
+            if (header.empty()) {
                 break;
             }
-            if (curlinemacro) {
-                break;
+            if (!strncasecmp(header.c_str(),"Content-Length:",15)) {
+                length = strtoul(header.c_str()+15,0,10);
+                havelength = true;
             }
-            break;
-        } // End switch on character
-        if (!incomment && !onelinecomment &&
-            !onquoteterminator && !inquotes) {
-            if (lastnmatch("if  ",inpos)) {
-                cout << line << ":" << inpos << " of "
-                    << path <<
-                    " has an if  , 2+ spaces after if"
-                    << endl;
-            } else if (lastnmatch("if(",inpos)) {
-                cout << line << ":" << inpos << " of "
-                    << path <<
-                    " has an if(, no space after if"
-                    << endl;
-            } else if (lastnmatch("for(",inpos)) {
-                cout << line << ":" << inpos << " of "
-                    << path <<
-                    " has a for(, no space after for"
-                    << endl;
-            } else if (lastnmatch("for  ",inpos)) {
-                cout << line << ":" << inpos << " of "
-                    << path <<
-                    " has a for  , two spaces after for"
-                    << endl;
+        }
+        if (!cin || !havelength) {
+            exit(shutdown? 0: 1);
+        }
+        if (length > LSPMAXMESSAGE) {
+            // Skip it rather than trying to hold it.
+            cin.ignore(length);
+            if ((size_t)cin.gcount() != length) {
+                exit(1);
             }
+            continue;
+        }
+        string text(length,'\0');
+        if (!cin.read(&text[0],length)) {
+            exit(1);
+        }
+        jsonval msg;
+        size_t pos = 0;
+        if (!json_parse(text,pos,msg) || msg.type != JOBJECT) {
+            continue;
+        }
+        const string &method = json_str(msg.get("method"));
+        const jsonval *id = msg.get("id");
+        const jsonval *params = msg.get("params");
+        jsonval noparams;
+        if (!params) {
+            params = &noparams;
+        }
+        if (!id && (method == "initialize" ||
+            method == "shutdown")) {
+            // Requests need an id, without one there is
+            // no way to answer.  Ignore them.
+            continue;
+        }
+        if (method == "initialize") {
+            lsp_reply(*id,"\"result\":{\"capabilities\":{"
+                "\"textDocumentSync\":{\"openClose\":true,"
+                "\"change\":2}},"
+                "\"serverInfo\":{\"name\":\"dicheck\"}}");
+        } else if (method == "textDocument/didOpen") {
+            lsp_open(*params);
+        } else if (method == "textDocument/didChange") {
+            lsp_change(*params);
+        } else if (method == "textDocument/didClose") {
+            lsp_close(*params);
+        } else if (method == "shutdown") {
+            shutdown = true;
+            lsp_reply(*id,"\"result\":null");
+        } else if (method == "exit") {
+            exit(shutdown? 0: 1);
+        } else if (id) {
+            lsp_reply(*id,"\"error\":{\"code\":-32601,"
+                "\"message\":\"method not found\"}");
         }
-    }
-    if (blankline) {
-        ++current_blankline_count;
-        ++ sequential_blankline_count;
-    } else {
-        current_blankline_count = 0;
-        found_nonblank_ever = true;
-        sequential_blankline_count = 0;
     }
 }
 
+// Combine the output of several --shard runs into
+// what one run over all the files would have printed.
 static void
-processfile(string &path, ifstream * mystream)
-{
-    unsigned char uc = 0;
-    char c = 0;
-    bool found_nonblank = false;
-    unsigned trailingwhitespace = 0;
-    unsigned line = 1;
-    unsigned lastlineindent = 0;
-    unsigned current_blankline_count = 0;
-    unsigned sequential_blankline_count = 0;
-    bool lastlinemacro = false;
-    bool done = false;
-    bool incomment = false;
-
-    while (!done) {
-        int indx = 0;
-        bool havenewline = false;
-        while ( mystream->get(c)) {
-            uc = c;
-            if (indx < OURBUFSIZ) {
-                inbuf[indx] = uc;
-                indx++;
-                inbuf[indx] = 0;
-                if (uc == '\n') {
-                    havenewline = true;
-                    incharcount = indx;
-                    break;
+merge_shards(int argc, char **argv, unsigned i)
+{
+    std::map<unsigned, string> blocks;
+    std::map<unsigned, string>::iterator it;
+    unsigned long errs = 0;
+    size_t marklen = strlen(shardmark);
+
+    if (i >= (unsigned)argc) {
+        cout << "--merge needs shard output files" << endl;
+        exit(1);
+    }
+    for (; i < (unsigned)argc; ++i) {
+        string f(argv[i]);
+        ifstream ist(f.c_str());
+        string text;
+        string *cur = 0;
+        bool complete = false;
+
+        if (!ist) {
+            cout << "Cannot open " << f << endl;
+            exit(1);
+        }
+        while (std::getline(ist,text)) {
+            if (text.compare(0,marklen,shardmark)) {
+                if (!cur) {
+                    cout << f << " is not dicheck --shard output"
+                        << endl;
+                    exit(1);
                 }
+                cur->append(text);
+                cur->push_back('\n');
                 continue;
             }
-            cout << line << " of " << path  <<
-                "Is too long. Likely not a text file at all. "
-                "Giving up"
-                <<endl;
-                exit(1);
-        }
-        if (!havenewline) {
-            if (indx > 0) {
-                // Non-terminated last line
-                cout << line << " of " << path  <<
-                    " does not have a newline!" <<endl;
-            } else {
-                done = true;
-                break;
+            const char *rest = text.c_str() + marklen;
+            if (!strncmp(rest,"errors ",7)) {
+                errs += strtoul(rest+7,0,10);
+                complete = true;
+                cur = 0;
+                continue;
             }
+            cur = &blocks[strtoul(rest,0,10)];
         }
-        process_a_line(line,path,
-            incomment,lastlinemacro,
-            found_nonblank,
-            lastlineindent, current_blankline_count,
-            sequential_blankline_count);
-        if (sequential_blankline_count > 1) {
-            cout << line << " of " << path  <<
-                " is " << sequential_blankline_count <<
-                " blank lines in a row" <<endl;
+        if (!complete) {
+            cout << f << " is incomplete, that shard failed"
+                << endl;
+            exit(1);
         }
-        ++line;
     }
-    if (current_blankline_count > 0) {
-        if (current_blankline_count == 1 ){
-            string singular= " last line is empty";
-            cout << "In "<< path  << singular<< endl;
-        } else {
-            string plural= " lines are empty";
-            cout << "In " << path << " last " <<
-                current_blankline_count <<
-                plural << endl;
-        }
+    for (it = blocks.begin(); it != blocks.end(); ++it) {
+        cout << it->second;
     }
-    return;
+    cout.flush();
+    exit(errs? 1: 0);
 }
 
 void
@@ -583,7 +3084,54 @@ usage()
     cout << "  where --linelength=<n> means report lines "
         "greater" <<endl;
     cout << "    than n characters long"<<endl;
-    cout << "Named files required as arguments" << endl;
+    cout << "  where --columns=codepoints or --columns=width"
+        <<endl;
+    cout << "    means count line lengths and columns in UTF-8"
+        <<endl;
+    cout << "    characters or display columns, not bytes, and"
+        <<endl;
+    cout << "    report invalid UTF-8" <<endl;
+    cout << "  where --baseline=<f> means do not report the"
+        <<endl;
+    cout << "    findings listed in f" <<endl;
+    cout << "  where --write-baseline=<f> means list the findings"
+        <<endl;
+    cout << "    in f, for use with --baseline" <<endl;
+    cout << "  where --summary means print only totals, a ranked"
+        <<endl;
+    cout << "    list of rules and files, and line length and"
+        <<endl;
+    cout << "    indent depth histograms" <<endl;
+    cout << "  where --shard=K/N means check only the K-th of N"
+        <<endl;
+    cout << "    size-balanced parts of the file list, not"
+        <<endl;
+    cout << "    with --summary" <<endl;
+    cout << "  where --merge means the files are --shard outputs"
+        <<endl;
+    cout << "    to be combined into one report" <<endl;
+    cout << "  where --files-from=<f> means also check the files"
+        <<endl;
+    cout << "    named in f, one per line, - means stdin" <<endl;
+    cout << "  where --pipeline means read, scan and print"
+        <<endl;
+    cout << "    on separate threads" <<endl;
+    cout << "  where --tar means the files are tar archives and"
+        <<endl;
+    cout << "    the regular files in them get checked,"
+        <<endl;
+    cout << "    not with --pipeline" <<endl;
+    cout << "  where --binary=<f> means also write the results"
+        <<endl;
+    cout << "    to f in binary, for dicheck-report" <<endl;
+    cout << "  where --lsp means run as a Language Server on"
+        <<endl;
+    cout << "    stdin and stdout" <<endl;
+    cout << "  where --trace=<f> means write a Chrome trace of"
+        <<endl;
+    cout << "    the run to f, for viewing in Perfetto" <<endl;
+    cout << "Named files required as arguments, - means stdin"
+        << endl;
     cout << "Use trimtrailing to remove trailing whitespace" << endl;
     exit(1);
 }
@@ -595,6 +3143,9 @@ main(int argc, char**argv)
         usage();
     } else {
         unsigned i = 1;
+        vector<string> filelists;
+        bool pipeline = false;
+
         for (; i < argc; ++i) {
             string f(argv[i]);
             if (f == "-l") {
@@ -632,16 +3183,113 @@ main(int argc, char**argv)
                 pythonsource = true;
                 continue;
             }
+            if (!strncmp(fp,"--columns=",10)) {
+                string mode(fp+10);
+
+                if (mode == "bytes") {
+                    columnmode = COL_BYTES;
+                } else if (mode == "codepoints") {
+                    columnmode = COL_CODEPOINTS;
+                } else if (mode == "width") {
+                    columnmode = COL_WIDTH;
+                    init_widths();
+                } else {
+                    cout << " Option --columns= must be bytes,"
+                        " codepoints or width" <<endl;
+                    exit(1);
+                }
+                continue;
+            }
+            if (!strncmp(fp,"--baseline=",11)) {
+                load_baseline(fp+11);
+                continue;
+            }
+            if (!strncmp(fp,"--write-baseline=",17)) {
+                writebasefile = fp+17;
+                continue;
+            }
+            if (f == "--summary") {
+                summarymode = true;
+                continue;
+            }
+            if (!strncmp(fp,"--shard=",8)) {
+                parse_shard(fp);
+                continue;
+            }
+            if (f == "--merge") {
+                merge_shards(argc,argv,i+1);
+            }
+            if (!strncmp(fp,"--files-from=",13)) {
+                filelists.push_back(string(fp+13));
+                continue;
+            }
+            if (f == "--pipeline") {
+                pipeline = true;
+                continue;
+            }
+            if (f == "--tar") {
+                tarmode = true;
+                continue;
+            }
+            if (!strncmp(fp,"--binary=",9)) {
+                binarymode = true;
+                binaryfile = fp+9;
+                continue;
+            }
+            if (f == "--lsp") {
+                run_lsp();
+            }
+            if (!strncmp(fp,"--trace=",8)) {
+                tracing = true;
+                tracefile = fp+8;
+                continue;
+            }
             break;
         }
-        for (; i < argc; ++i) {
-            string f(argv[i]);
-            ifstream ist(f.c_str());
-            if (!ist) {
-                cout << "Cannot open " << f << endl;
-                exit(1);
-            }
-            processfile(f,&ist);
+        if (shardcount && summarymode) {
+            // --merge needs each file's diagnostics, which
+            // --summary does not print.
+            cout << " Option --shard= cannot be used with --summary"
+                << endl;
+            exit(1);
+        }
+        if (pipeline && tarmode) {
+            // check_tar() feeds members to processfile()
+            // itself, the pipeline stages take whole files.
+            cout << " Option --pipeline cannot be used with --tar"
+                << endl;
+            exit(1);
+        }
+        vector<string> files(argv+i,argv+argc);
+        trace_thread("main");
+        for (i = 0; i < filelists.size(); ++i) {
+            read_file_list(filelists[i],files);
+        }
+        vector<bool> selected(files.size(),true);
+        bool marks = shardcount != 0;
+
+        if (shardcount) {
+            select_shard(files,selected);
+        }
+        if (pipeline) {
+            run_pipeline(files,selected,marks);
+        } else {
+            run_serial(files,selected,marks);
+        }
+        if (marks) {
+            cout << shardmark << "errors " << errcount << endl;
+        }
+        if (summarymode) {
+            print_summary();
+        }
+        if (tracing) {
+            write_trace();
+        }
+        if (binarymode) {
+            write_binary();
+        }
+        if (!writebasefile.empty()) {
+            write_baseline();
         }
     }
     if (errcount) {
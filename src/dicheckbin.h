@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2021 David Anderson.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with
+or without modification, are permitted provided that the
+following conditions are met:
+
+    Redistributions of source code must retain the above
+    copyright notice, this list of conditions and the following
+    disclaimer.
+
+    Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following
+    disclaimer in the documentation and/or other materials
+    provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+// The binary result file written by dicheck --binary=<f>
+// and read by dicheck-report.  Everything after the magic
+// is unsigned LEB128 varints, so the file can be mapped
+// and walked in place:
+//   "DICHKB01"
+//   rule count, then each rule name as length, bytes
+//   path count, then each path as length, bytes.
+//       Paths are sorted, so path order is index order.
+//   record count, then each record as
+//       path index (delta from the previous record),
+//       line (delta from the previous record if the
+//       path index did not change), col, rule, v1, v2.
+// Records are sorted by path, line, col, rule, v1, v2.
+
+#ifndef DICHECKBIN_H
+#define DICHECKBIN_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dicheckrules.h"
+
+#define BINMAGIC    "DICHKB01"
+#define BINMAGICLEN 8
+
+struct binrecord {
+    unsigned path;  // Index into the path table.
+    diag     d;
+};
+
+static inline bool
+binrecord_less(const binrecord &a, const binrecord &b)
+{
+    if (a.path != b.path) {
+        return a.path < b.path;
+    }
+    if (a.d.line != b.d.line) {
+        return a.d.line < b.d.line;
+    }
+    if (a.d.col != b.d.col) {
+        return a.d.col < b.d.col;
+    }
+    if (a.d.rule != b.d.rule) {
+        return a.d.rule < b.d.rule;
+    }
+    if (a.d.v1 != b.d.v1) {
+        return a.d.v1 < b.d.v1;
+    }
+    return a.d.v2 < b.d.v2;
+}
+
+static inline void
+put_varint(std::string &out, unsigned long long v)
+{
+    while (v >= 0x80) {
+        out.push_back((char)(0x80 | (v & 0x7f)));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static inline void
+put_bytes(std::string &out, const std::string &s)
+{
+    put_varint(out,s.size());
+    out.append(s);
+}
+
+static inline bool
+get_varint(const unsigned char *&p, const unsigned char *end,
+    unsigned long long &v)
+{
+    unsigned shift = 0;
+
+    v = 0;
+    while (p < end && shift < 64) {
+        unsigned char c = *p++;
+
+        v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+// paths must be sorted and recs sorted with
+// binrecord_less.  Returns false if the write failed.
+static inline bool
+bin_write(const std::string &name,
+    const std::vector<std::string> &paths,
+    const std::vector<binrecord> &recs)
+{
+    std::string out(BINMAGIC);
+    unsigned lastpath = 0;
+    unsigned lastline = 0;
+    size_t i = 0;
+
+    put_varint(out,R_COUNT);
+    for (i = 0; i < R_COUNT; ++i) {
+        put_bytes(out,rulenames[i]);
+    }
+    put_varint(out,paths.size());
+    for (i = 0; i < paths.size(); ++i) {
+        put_bytes(out,paths[i]);
+    }
+    put_varint(out,recs.size());
+    for (i = 0; i < recs.size(); ++i) {
+        const binrecord &r = recs[i];
+
+        put_varint(out,r.path - lastpath);
+        if (r.path != lastpath) {
+            lastline = 0;
+        }
+        put_varint(out,r.d.line - lastline);
+        put_varint(out,r.d.col);
+        put_varint(out,r.d.rule);
+        put_varint(out,r.d.v1);
+        put_varint(out,r.d.v2);
+        lastpath = r.path;
+        lastline = r.d.line;
+    }
+    std::ofstream f(name.c_str(),std::ios::binary);
+    f.write(out.data(),out.size());
+    f.close();
+    return !f.fail();
+}
+
+struct binpath {
+    const char *p;
+    size_t      len;
+};
+
+// A mapped binary result file.
+struct binfile {
+    std::string name;
+    const unsigned char *map;
+    size_t size;
+    std::vector<binpath> paths;
+    const unsigned char *records;
+    unsigned long long count;
+};
+
+// Returns false, with the file unmapped, if it is
+// not a binary result file.
+static inline bool
+bin_open(const std::string &name, binfile &bf)
+{
+    int fd = open(name.c_str(),O_RDONLY);
+    struct stat st;
+    unsigned long long n = 0;
+    unsigned long long len = 0;
+    unsigned long long i = 0;
+
+    bf.name = name;
+    bf.map = 0;
+    bf.size = 0;
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd,&st) < 0 || st.st_size < BINMAGICLEN) {
+        close(fd);
+        return false;
+    }
+    bf.size = st.st_size;
+    void *m = mmap(0,bf.size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    bf.map = (const unsigned char *)m;
+    const unsigned char *p = bf.map + BINMAGICLEN;
+    const unsigned char *end = bf.map + bf.size;
+    bool ok = !memcmp(bf.map,BINMAGIC,BINMAGICLEN);
+
+    // The rule names are only there for other readers,
+    // rule ids never change meaning.
+    ok = ok && get_varint(p,end,n);
+    for (i = 0; ok && i < n; ++i) {
+        ok = get_varint(p,end,len) && len <= (size_t)(end-p);
+        p += ok? len: 0;
+    }
+    ok = ok && get_varint(p,end,n);
+    for (i = 0; ok && i < n; ++i) {
+        binpath bp;
+
+        ok = get_varint(p,end,len) && len <= (size_t)(end-p);
+        if (ok) {
+            bp.p = (const char *)p;
+            bp.len = len;
+            bf.paths.push_back(bp);
+            p += len;
+        }
+    }
+    ok = ok && get_varint(p,end,bf.count);
+    if (!ok) {
+        munmap(m,bf.size);
+        bf.map = 0;
+        return false;
+    }
+    bf.records = p;
+    return true;
+}
+
+// Walks the records of a binfile in order.
+struct bincursor {
+    const binfile *bf;
+    const unsigned char *p;
+    unsigned long long left;
+    binrecord r;
+    bool valid;     // r holds a record.
+    bool corrupt;
+};
+
+static inline bool
+bin_next(bincursor &c)
+{
+    const unsigned char *end = c.bf->map + c.bf->size;
+    unsigned long long v[6];
+    unsigned i = 0;
+
+    c.valid = false;
+    if (!c.left || c.corrupt) {
+        return false;
+    }
+    for (i = 0; i < 6; ++i) {
+        if (!get_varint(c.p,end,v[i])) {
+            c.corrupt = true;
+            return false;
+        }
+    }
+    if (v[0]) {
+        c.r.d.line = 0;
+    }
+    c.r.path += v[0];
+    if (c.r.path >= c.bf->paths.size()) {
+        c.corrupt = true;
+        return false;
+    }
+    c.r.d.line += v[1];
+    c.r.d.col = v[2];
+    c.r.d.rule = v[3];
+    c.r.d.v1 = v[4];
+    c.r.d.v2 = v[5];
+    --c.left;
+    c.valid = true;
+    return true;
+}
+
+static inline void
+bin_start(const binfile &bf, bincursor &c)
+{
+    c.bf = &bf;
+    c.p = bf.records;
+    c.left = bf.count;
+    c.r.path = 0;
+    c.r.d.line = 0;
+    c.valid = false;
+    c.corrupt = false;
+    bin_next(c);
+}
+
+static inline std::string
+bin_path(const bincursor &c)
+{
+    const binpath &bp = c.bf->paths[c.r.path];
+
+    return std::string(bp.p,bp.len);
+}
+
+// Orders records of two different files, which
+// have their own path tables.
+static inline int
+bin_compare(const bincursor &a, const bincursor &b)
+{
+    const binpath &pa = a.bf->paths[a.r.path];
+    const binpath &pb = b.bf->paths[b.r.path];
+    size_t n = pa.len < pb.len? pa.len: pb.len;
+    int res = memcmp(pa.p,pb.p,n);
+
+    if (res) {
+        return res;
+    }
+    if (pa.len != pb.len) {
+        return pa.len < pb.len? -1: 1;
+    }
+    binrecord ra = a.r;
+    binrecord rb = b.r;
+    ra.path = rb.path = 0;
+    if (binrecord_less(ra,rb)) {
+        return -1;
+    }
+    return binrecord_less(rb,ra)? 1: 0;
+}
+
+#endif /* DICHECKBIN_H */
@@ -0,0 +1,252 @@
+/*
+Copyright (c) 2021 David Anderson.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with
+or without modification, are permitted provided that the
+following conditions are met:
+
+    Redistributions of source code must retain the above
+    copyright notice, this list of conditions and the following
+    disclaimer.
+
+    Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following
+    disclaimer in the documentation and/or other materials
+    provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+// dicheck-report reads the binary result files that
+// dicheck --binary=<f> writes.  All the files are sorted
+// the same way, so merging them and comparing against a
+// baseline are single linear passes over the mapped
+// files with no text parsing.
+//
+// To build try:
+//      g++ dicheckreport.cc -o dicheck-report
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <cstdlib>  // for exit()
+#include <stdlib.h>
+#include <string.h>
+#include "dicheckrules.h"
+#include "dicheckbin.h"
+
+using std::string;
+using std::cout;
+using std::endl;
+using std::vector;
+
+// Usage:  dicheck-report [options] file.bin ...
+
+static int    onlyrule = -1;
+static string onlypath;
+static string baselinefile;
+static string outfile;
+
+// Output goes to cout as text, or with -o to outfile.
+static vector<string> outpaths;
+static vector<binrecord> outrecords;
+static unsigned long outcount = 0;
+
+static bool
+wanted(const bincursor &c)
+{
+    if (onlyrule >= 0 && c.r.d.rule != (unsigned)onlyrule) {
+        return false;
+    }
+    if (!onlypath.empty()) {
+        const binpath &bp = c.bf->paths[c.r.path];
+
+        if (!memmem(bp.p,bp.len,onlypath.data(),onlypath.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+output(const bincursor &c)
+{
+    ++outcount;
+    if (outfile.empty()) {
+        if (c.r.d.rule < R_COUNT) {
+            format_diag(cout,c.r.d,bin_path(c));
+        }
+        return;
+    }
+    // Records arrive in path order so the path table
+    // only ever grows at the end.
+    string path = bin_path(c);
+    binrecord r = c.r;
+
+    if (outpaths.empty() || outpaths.back() != path) {
+        outpaths.push_back(path);
+    }
+    r.path = outpaths.size()-1;
+    outrecords.push_back(r);
+}
+
+// Index of the cursor with the smallest record, or -1.
+static int
+smallest(vector<bincursor> &cursors)
+{
+    int best = -1;
+    unsigned i = 0;
+
+    for (i = 0; i < cursors.size(); ++i) {
+        if (!cursors[i].valid) {
+            continue;
+        }
+        if (best < 0 || bin_compare(cursors[i],cursors[best]) < 0) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void
+check_corrupt(const bincursor &c)
+{
+    if (c.corrupt) {
+        cout << c.bf->name << " is corrupt" << endl;
+        exit(2);
+    }
+}
+
+static void
+usage()
+{
+    cout << "dicheck-report [--rule=<name>] [--path=<text>] "
+        "[--new=<base.bin>]" << endl;
+    cout << "    [-o <out.bin>] file.bin ..." << endl;
+    cout << "  Merges the dicheck --binary results given and prints"
+        << endl;
+    cout << "  them as dicheck would." << endl;
+    cout << "  where --rule=<name> means only that rule" << endl;
+    cout << "  where --path=<text> means only paths containing text"
+        << endl;
+    cout << "  where --new=<base.bin> means only results that are"
+        << endl;
+    cout << "    not in base.bin" << endl;
+    cout << "  where -o <out.bin> means write the results to out.bin"
+        << endl;
+    cout << "    in binary rather than printing them" << endl;
+    cout << "  Exits 1 if there are any results, 0 if not." << endl;
+    exit(2);
+}
+
+int
+main(int argc, char**argv)
+{
+    vector<binfile> files;
+    vector<bincursor> cursors;
+    binfile base;
+    bincursor basecur = bincursor();
+    int i = 1;
+
+    for (; i < argc; ++i) {
+        string f(argv[i]);
+        const char *fp = f.c_str();
+
+        if (f == "-h") {
+            usage();
+        } else if (!strncmp(fp,"--rule=",7)) {
+            for (onlyrule = 0; onlyrule < R_COUNT; ++onlyrule) {
+                if (!strcmp(fp+7,rulenames[onlyrule])) {
+                    break;
+                }
+            }
+            if (onlyrule == R_COUNT) {
+                cout << "Unknown rule " << fp+7 << endl;
+                exit(2);
+            }
+        } else if (!strncmp(fp,"--path=",7)) {
+            onlypath = fp+7;
+        } else if (!strncmp(fp,"--new=",6)) {
+            baselinefile = fp+6;
+        } else if (f == "-o" && i+1 < argc) {
+            outfile = argv[++i];
+        } else {
+            break;
+        }
+    }
+    if (i >= argc) {
+        usage();
+    }
+    files.resize(argc-i);
+    cursors.resize(files.size());
+    for (unsigned k = 0; i < argc; ++i, ++k) {
+        if (!bin_open(argv[i],files[k])) {
+            cout << argv[i] << " is not a dicheck binary result file"
+                << endl;
+            exit(2);
+        }
+    }
+    for (unsigned k = 0; k < files.size(); ++k) {
+        bin_start(files[k],cursors[k]);
+        check_corrupt(cursors[k]);
+    }
+    if (!baselinefile.empty()) {
+        if (!bin_open(baselinefile,base)) {
+            cout << baselinefile <<
+                " is not a dicheck binary result file" << endl;
+            exit(2);
+        }
+        bin_start(base,basecur);
+        check_corrupt(basecur);
+    }
+    for (;;) {
+        int s = smallest(cursors);
+
+        if (s < 0) {
+            break;
+        }
+        bincursor &c = cursors[s];
+        bool inbase = false;
+
+        // Both sides are sorted, so skip the baseline
+        // forward to where this record would be.
+        while (basecur.valid) {
+            int res = bin_compare(basecur,c);
+
+            if (res > 0) {
+                break;
+            }
+            if (res == 0) {
+                inbase = true;
+            }
+            bin_next(basecur);
+            check_corrupt(basecur);
+            if (inbase) {
+                break;
+            }
+        }
+        if (!inbase && wanted(c)) {
+            output(c);
+        }
+        bin_next(c);
+        check_corrupt(c);
+    }
+    if (!outfile.empty() &&
+        !bin_write(outfile,outpaths,outrecords)) {
+        cout << "Cannot write " << outfile << endl;
+        exit(2);
+    }
+    exit(outcount? 1: 0);
+}
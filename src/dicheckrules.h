@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2021 David Anderson.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with
+or without modification, are permitted provided that the
+following conditions are met:
+
+    Redistributions of source code must retain the above
+    copyright notice, this list of conditions and the following
+    disclaimer.
+
+    Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following
+    disclaimer in the documentation and/or other materials
+    provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+// The rules dicheck checks and how their diagnostics
+// read.  Shared by dicheck and dicheck-report so both
+// print exactly the same text.
+
+#ifndef DICHECKRULES_H
+#define DICHECKRULES_H
+
+#include <string>
+#include <iostream>
+
+// Every diagnostic dicheck issues has a rule.
+// The enum value is the rule id, add new rules at the end.
+enum dirule {
+    R_DEBUGPRINTF,
+    R_BLANKBRACE,
+    R_NOQUOTEEND,
+    R_LEADINGBLANK,
+    R_TRAILINGSPACE,
+    R_BADINDENT,
+    R_INDENTCHANGE,
+    R_LINELENGTH,
+    R_TAB,
+    R_IFTWOSPACE,
+    R_IFNOSPACE,
+    R_FORNOSPACE,
+    R_FORTWOSPACE,
+    R_NONEWLINE,
+    R_BLANKLINES,
+    R_TRAILINGBLANK,
+    R_NOTTEXT,
+    R_BADUTF8,
+    R_COUNT
+};
+
+static const char *rulenames[R_COUNT] = {
+    "debug-printf",
+    "blank-between-braces",
+    "unterminated-quote",
+    "leading-blank-line",
+    "trailing-whitespace",
+    "bad-indent",
+    "bad-indent-change",
+    "line-length",
+    "tab",
+    "if-two-spaces",
+    "if-no-space",
+    "for-no-space",
+    "for-two-spaces",
+    "no-final-newline",
+    "blank-lines-in-a-row",
+    "trailing-blank-lines",
+    "not-text",
+    "invalid-utf8"
+};
+
+// One finding. col, v1 and v2 mean whatever
+// the rule's message needs them to mean.
+struct diag {
+    unsigned rule;
+    unsigned line;
+    unsigned col;
+    unsigned v1;
+    unsigned v2;
+};
+
+static void
+format_diag(std::ostream &out, const diag &d, const std::string &path)
+{
+    switch(d.rule) {
+    case R_DEBUGPRINTF:
+        out << d.line << " of " << path  <<
+            " seems to be leftover debug printf" << std::endl;
+        break;
+    case R_BLANKBRACE:
+        out << d.line << " of " << path  <<
+            " is blank surrounded by }" << std::endl;
+        break;
+    case R_NOQUOTEEND:
+        out << d.line << " of " << path  <<
+            " has a non-terminated quote"<< std::endl;
+        break;
+    case R_LEADINGBLANK:
+        out << d.line << " of " << path  <<
+            " is a leading blank line "<< std::endl;
+        break;
+    case R_TRAILINGSPACE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has " << d.v1 <<
+            " whitespace chars on the end. " << std::endl;
+        break;
+    case R_BADINDENT:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has a bad indent. " << std::endl;
+        break;
+    case R_INDENTCHANGE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has a bad indent change, last indent " <<
+            d.v1 << "  cur indent " << d.v2 << std::endl;
+        break;
+    case R_LINELENGTH:
+        out << d.line << ": " << d.col << " of " << path <<
+            "  is " << d.v1 << " characters long" <<std::endl;
+        break;
+    case R_TAB:
+        out << d.line << ":" << d.col << " of " << path <<
+            " is a tab. " << std::endl;
+        break;
+    case R_IFTWOSPACE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has an if  , 2+ spaces after if" << std::endl;
+        break;
+    case R_IFNOSPACE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has an if(, no space after if" << std::endl;
+        break;
+    case R_FORNOSPACE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has a for(, no space after for" << std::endl;
+        break;
+    case R_FORTWOSPACE:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has a for  , two spaces after for" << std::endl;
+        break;
+    case R_NONEWLINE:
+        out << d.line << " of " << path  <<
+            " does not have a newline!" <<std::endl;
+        break;
+    case R_BLANKLINES:
+        out << d.line << " of " << path  <<
+            " is " << d.v1 << " blank lines in a row" <<std::endl;
+        break;
+    case R_TRAILINGBLANK:
+        if (d.v1 == 1 ){
+            out << "In "<< path  << " last line is empty" <<
+                std::endl;
+        } else {
+            out << "In " << path << " last " << d.v1 <<
+                " lines are empty" << std::endl;
+        }
+        break;
+    case R_NOTTEXT:
+        out << d.line << " of " << path  <<
+            "Is too long. Likely not a text file at all. "
+            "Giving up" <<std::endl;
+        break;
+    case R_BADUTF8:
+        out << d.line << ":" << d.col << " of " << path <<
+            " has an invalid UTF-8 sequence" << std::endl;
+        break;
+    }
+}
+
+#endif /* DICHECKRULES_H */
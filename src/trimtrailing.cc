@@ -30,6 +30,13 @@ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 // compile with something like
 // g++ trimtrailing.cc -o trimtrailing
+//
+// The input file is mapped once and the output is
+// written as iovecs pointing at unchanged spans of
+// that mapping, so the cost of a rewrite is driven by
+// the number of edits, not by the size of the file.
+// Long spans with nothing to trim are handed to
+// copy_file_range() where the kernel supports it.
 
 #include <string>
 #include <iostream>
@@ -40,6 +47,14 @@ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <string.h>
 #include <errno.h>
 #include <libgen.h> /* for basename */
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using std::ofstream;
 using std::ifstream;
@@ -50,101 +65,237 @@ using std::cin;
 
 // Usage:  trimtrailing  file ...
 
-#define OURBUFSIZE  2000
+// Well under IOV_MAX on any system we care about.
+#define OURIOVMAX    256
+// Spans at least this long go through copy_file_range().
+#define COPYRANGEMIN (64*1024)
+
+struct outqueue {
+    int      outfd;
+    int      infd;
+    const unsigned char *base;
+    struct iovec iov[OURIOVMAX];
+    int      iovcount;
+    bool     failed;
+};
+
 static void
-process_a_line(int line,
-    string&path,
-    unsigned char* inbuf,
-    int inbuflen,
-    ofstream *fileout,
-    unsigned & blankline_count)
+write_iovs(outqueue &q, struct iovec *iov, int count)
 {
-    int i = 0;
-    unsigned char c = 0;
-    unsigned char outbuf[OURBUFSIZE+1];
-    int outpos = 0;
-    int trailingwhitespace = 0;
-    int done = 0;
-
-    outbuf[0] = 0;
-    for ( ; !done && i < inbuflen ; ++i) {
-        c = inbuf[i];
-        switch(c) {
-        case '\n': {
-            if (!(outpos-trailingwhitespace)) {
-                if (blankline_count) {
-                    break;
-                }
-                ++blankline_count;
-            } else {
-                blankline_count = 0;
+    while (count > 0 && !q.failed) {
+        ssize_t res = writev(q.outfd, iov, count);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            fileout->write((const char *)outbuf,
-                outpos-trailingwhitespace);
-            fileout->put('\n');
-            done = 1;
-            break;
+            q.failed = true;
+            return;
         }
-        case '\v': // Vertical tab.
-            trailingwhitespace += 1;
-            outbuf[outpos++] = c;
-            break;
-        case ' ':
-            trailingwhitespace += 1;
-            outbuf[outpos++] = c;
-            break;
-        case '\t':
-            trailingwhitespace += 1;
-            outbuf[outpos++] = c;
-            break;
-        default:
-            trailingwhitespace = 0;
-            outbuf[outpos++] = c;
+        size_t done = res;
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            // Partial write, resume inside this iovec.
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+static void
+copy_span(outqueue &q, struct iovec *iov)
+{
+#ifdef __linux__
+    loff_t inoff = (const unsigned char *)iov->iov_base - q.base;
+    size_t left = iov->iov_len;
+
+    while (left > 0) {
+        ssize_t res = copy_file_range(q.infd, &inoff,
+            q.outfd, 0, left, 0);
+        if (res <= 0) {
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            // EXDEV, ENOSYS etc: write the rest ourselves.
             break;
         }
+        left -= res;
+    }
+    if (!left) {
+        return;
+    }
+    iov->iov_base = (char *)iov->iov_base + (iov->iov_len - left);
+    iov->iov_len = left;
+#endif
+    write_iovs(q, iov, 1);
+}
+
+static void
+flushqueue(outqueue &q)
+{
+    int first = 0;
+    int i = 0;
+
+    for ( ; i < q.iovcount; ++i) {
+        if (q.iov[i].iov_len < COPYRANGEMIN) {
+            continue;
+        }
+        write_iovs(q, q.iov+first, i-first);
+        copy_span(q, q.iov+i);
+        first = i+1;
     }
+    write_iovs(q, q.iov+first, i-first);
+    q.iovcount = 0;
 }
 
+// Queue len bytes of the mapping starting at start.
+// A span that continues the previous one just extends it.
 static void
-processfile(string &path, ifstream&mystream,
-    ofstream *fileout)
+addspan(outqueue &q, const unsigned char *start, size_t len)
 {
-    static unsigned char inbuf[OURBUFSIZE+1];
-    bool done = false;
-    int line = 0;
+    if (!len) {
+        return;
+    }
+    if (q.iovcount) {
+        struct iovec *last = q.iov + q.iovcount -1;
+        if ((const unsigned char *)last->iov_base +
+            last->iov_len == start) {
+            last->iov_len += len;
+            return;
+        }
+        if (q.iovcount == OURIOVMAX) {
+            flushqueue(q);
+        }
+    }
+    q.iov[q.iovcount].iov_base = (void *)start;
+    q.iov[q.iovcount].iov_len = len;
+    ++q.iovcount;
+}
+
+static bool
+is_trimmable(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\v';
+}
+
+// Returns the length of the line once trailing
+// space, tab and vertical-tab characters are removed.
+static size_t
+trimmedlength(const unsigned char *start, size_t len)
+{
+    if (!len || !is_trimmable(start[len-1])) {
+        // The usual case, nothing to trim.
+        return len;
+    }
+#ifdef __SSE2__
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tb = _mm_set1_epi8('\t');
+    const __m128i vt = _mm_set1_epi8('\v');
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128(
+            (const __m128i *)(start + len - 16));
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v,sp),
+            _mm_or_si128(_mm_cmpeq_epi8(v,tb),
+            _mm_cmpeq_epi8(v,vt)));
+        unsigned keep = ~_mm_movemask_epi8(ws) & 0xffff;
+
+        if (keep) {
+            // Highest non-whitespace byte in this block.
+            return len - 16 + (32 - __builtin_clz(keep));
+        }
+        len -= 16;
+    }
+#endif
+    while (len && is_trimmable(start[len-1])) {
+        --len;
+    }
+    return len;
+}
+
+// Multiple blank lines in a row are reduced to one.
+// As always, an unterminated final line is not copied.
+static void
+processfile(const unsigned char *base, size_t size,
+    outqueue &q)
+{
+    const unsigned char *p = base;
+    const unsigned char *end = base + size;
     unsigned blankline_count = 0;
 
-    while (!done) {
-        int           indx = 0;
-        bool          havenewline = false;
-        char          c = 0;
-        unsigned char uc = 0;
-
-        ++line;
-        while (mystream.get(c)) {
-            if (indx < OURBUFSIZE) {
-                inbuf[indx] = (unsigned char)c;
-                indx++;
-                inbuf[indx] = 0;
-                if (c == '\n') {
-                    havenewline = true;
-                    break;
-                }
+    while (p < end) {
+        const unsigned char *nl = (const unsigned char *)
+            memchr(p,'\n',end-p);
+        if (!nl) {
+            break;
+        }
+        size_t linelen = nl - p;
+        size_t keep = trimmedlength(p,linelen);
+
+        if (!keep) {
+            if (blankline_count) {
+                p = nl+1;
                 continue;
             }
-            cout << line << " of " << path  <<
-                "Is too long. Likely not a text file at all. "
-                "Giving up"
-                <<endl;
-                exit(1);
+            ++blankline_count;
+        } else {
+            blankline_count = 0;
         }
-        process_a_line(line,path,inbuf,indx,fileout, blankline_count);
-        indx = 0;
-        if (!havenewline) {
-            done = true;
+        if (keep == linelen) {
+            addspan(q,p,linelen+1);
+        } else {
+            addspan(q,p,keep);
+            addspan(q,nl,1);
         }
+        p = nl+1;
     }
-    return;
+    flushqueue(q);
+}
+
+// Returns false if anything went wrong writing outname.
+static bool
+trimfile(string &f, string &outname)
+{
+    int infd = open(f.c_str(),O_RDONLY);
+    if (infd < 0) {
+        cout << "Cannot open " << f << endl;
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(infd,&st) < 0) {
+        cout << "Cannot stat " << f << endl;
+        exit(1);
+    }
+    int outfd = open(outname.c_str(),
+        O_WRONLY|O_CREAT|O_TRUNC,0666);
+    if (outfd < 0) {
+        cout << "Cannot open output " << outname << endl;
+        exit(1);
+    }
+    static outqueue q;
+    q.outfd = outfd;
+    q.infd = infd;
+    q.iovcount = 0;
+    q.failed = false;
+    size_t size = st.st_size;
+    if (size) {
+        void *m = mmap(0,size,PROT_READ,MAP_PRIVATE,infd,0);
+        if (m == MAP_FAILED) {
+            cout << "Cannot mmap " << f << endl;
+            exit(1);
+        }
+        madvise(m,size,MADV_SEQUENTIAL);
+        q.base = (const unsigned char *)m;
+        processfile(q.base,size,q);
+        munmap(m,size);
+    }
+    close(infd);
+    if (close(outfd) < 0) {
+        q.failed = true;
+    }
+    return !q.failed;
 }
 
 void
@@ -179,19 +330,11 @@ main(int argc, char**argv)
                 saveout = true;
                 continue;
             }
-            ifstream ist(f.c_str());
-            if (!ist) {
-                cout << "Cannot open " << f << endl;
-                exit(1);
-            }
             string outname = f + ".out";
-            ofstream fout(outname.c_str());
-            if (!fout) {
-                cout << "Cannot open output " << outname << endl;
+            if (!trimfile(f,outname)) {
+                cout << "Write of " << outname << " failed." << endl;
                 exit(1);
             }
-            processfile(f,ist,&fout);
-            fout.flush();
             if (! saveout) {
                 int res = rename(outname.c_str(),f.c_str());
                 if (res < 0) {
@@ -0,0 +1,70 @@
+#!/bin/sh
+
+#sh test/checktrace.sh test/junktrace test/basettrace
+
+# A --trace file is one JSON object holding an array
+# of events, one event per line.  Check that shape,
+# then compare the events with times zeroed and thread
+# ids named, as those change from run to run.
+
+if [ $# -ne 2 ]
+then
+  echo "FAIL bad test command $*"
+  exit 1
+fi
+t=$1
+b=$2
+n=test/junktracenorm
+
+if [ "`head -n 1 $t`" != '{"traceEvents":[' ]
+then
+  echo "FAIL $t does not start a traceEvents array"
+  exit 1
+fi
+if [ "`tail -n 1 $t`" != ']}' ]
+then
+  echo "FAIL $t does not end the traceEvents array"
+  exit 1
+fi
+# Every event but the last ends in a comma.
+sed -e '1d' -e '$d' $t | sed '$d' | grep -v '^{.*},$' >$n
+if [ -s $n ]
+then
+  echo "FAIL $t has a badly formed or unseparated event"
+  cat $n
+  exit 1
+fi
+sed -e '1d' -e '$d' $t | tail -n 1 | grep -v '^{.*}$' >$n
+if [ -s $n ]
+then
+  echo "FAIL $t has a badly formed last event"
+  cat $n
+  exit 1
+fi
+# Each thread's thread_name event comes before its
+# other events, so thread ids can be turned into names.
+sed -e '1d' -e '$d' -e 's/,$//' \
+  -e 's/"ts":[0-9.]*/"ts":0/' \
+  -e 's/"dur":[0-9.]*/"dur":0/' $t | awk '
+{
+  if (match($0,/"tid":[0-9]+/)) {
+    id = substr($0,RSTART+6,RLENGTH-6)
+    if ($0 ~ /"thread_name"/) {
+      name = $0
+      sub(/.*"args":\{"name":"/,"",name)
+      sub(/".*/,"",name)
+      names[id] = name
+    }
+    sub(/"tid":[0-9]+/,"\"tid\":\"" names[id] "\"")
+  }
+  print
+}' | LC_ALL=C sort >$n
+diff $b $n >test/junk.difference
+if [ $? -ne 0 ]
+then
+  echo "FAIL  $* "
+  cat test/junk.difference
+  echo "To update: mv $n $b"
+  exit 1
+fi
+exit 0